@@ -20,6 +20,9 @@ MAX3140 MOSI   GPIO10   pin 19  SPI0 MOSI
 MAX3140 MISO   GPIO9    pin 21  SPI0 MISO
 MAX3140 CE     GPIO8    pin 24  SPI0 CE0
 
+A second MAX3140 can be connected to SPI0 CE1 (GPIO7, pin 26) with its INT
+on a free GPIO, the ports are then described in the device tree.
+
 
 Overlays needed:
   spi0-hw-cs
@@ -59,11 +62,27 @@ Overlays needed:
 #include <linux/ktime.h>
 #include <linux/platform_device.h>
 #include <linux/clk.h>
+// for the port nodes in the device tree
+#include <linux/of.h>
+#include <linux/of_gpio.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/pm_qos.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
+// for hweight8()
+#include <linux/bitops.h>
 
 #include "module.h"
 // needed for queue_xxx functions
 #include "queue.h"
 
+// tracepoints, defined in this file
+#define CREATE_TRACE_POINTS
+#include "raspicomm_trace.h"
+
 // }}} includes
 //============================================================================
 // {{{ driver defines
@@ -154,6 +173,11 @@ typedef enum {
 	// index (bit nr) of the parity bit in the config commands
 	MAX3140_PARITY_BIT_INDEX		= 8,
 
+	// the data responses report a framing error of the received byte and
+	// its parity bit
+	MAX3140_RX_FRAMING_ERROR		= 1 << 10,
+	MAX3140_RX_PARITY_BIT			= 1 << MAX3140_PARITY_BIT_INDEX,
+
 	// the write data command doe snot send a byte if this flag is set
 	MAX3140_WRDAT_DO_NOT_TRANSMIT   = 1 << 10,
 	// if set the transmitter is disabled and receiving data is possible
@@ -162,9 +186,17 @@ typedef enum {
 	MAX3140_CMD_RECEIVE_MODE		= MAX3140_CMD_WRITE_DATA |
 										MAX3140_WRDAT_DO_NOT_TRANSMIT |
 										MAX3140_WRDAT_TRANSMITTER_OFF,
+	// enables the RS485 driver without sending a byte
+	MAX3140_CMD_TRANSMIT_MODE		= MAX3140_CMD_WRITE_DATA |
+										MAX3140_WRDAT_DO_NOT_TRANSMIT,
 
 } MAX3140_Flags;
 
+// config bits compared after a RdCfg, the interrupt enables change while
+// transmitting and in polled RX mode
+#define MAX3140_CONFIG_READBACK_MASK	(MAX3140_CONFIG_MASK & \
+		~(MAX3140_CFG_ENABLE_TX_INT | MAX3140_CFG_ENABLE_RX_INT))
+
 
 typedef struct {
 	struct spi_message msg;
@@ -187,6 +219,9 @@ typedef struct {
 	const char* name;
 } rpc_spi_msg2_t;
 
+// words in the receive FIFO of the MAX3140
+#define MAX3140_RX_FIFO_SIZE	8
+
 // }}} MAX3140 definitions
 //============================================================================
 // {{{ BCM2835 SPI definitions
@@ -255,99 +290,725 @@ typedef struct {
 #define BCM2835_SPI_CS_CS_1			0x00000001
 #define BCM2835_SPI_CS_CS_2			0x00000002
 
-// #define BCM2835_SPI_POLLING_LIMIT_US	30
+// transfers are polled as long as the expected time stays below this
+#define BCM2835_SPI_POLLING_LIMIT_US	30
+// highest SCLK of the MAX3140
+#define MAX3140_SCLK_MAX_HZ		4000000
+// default SCLK, kept from the fixed divider used before
+#define SPI_DEFAULT_HZ			1000000
+// SPI clocks tried by the calibration, from slow to fast
+#define RPC_CALIB_STEPS		5
+// RdCfg round trips per port and SPI clock
+#define RPC_CALIB_ROUNDS	64
+// the error recovery never lowers SCLK below this
+#define SPI_MIN_HZ				500000
+// CS register snapshots of the last FIFO errors
+#define RPC_SPI_ERROR_SNAPSHOTS	8
+// a transfer completed by the interrupt is given this long plus the time
+// of a few words before the watchdog takes over
+#define SPI_WATCHDOG_SLACK_NS	(2 * NSEC_PER_MSEC)
 // #define BCM2835_SPI_POLLING_JIFFIES	2
 // #define BCM2835_SPI_DMA_MIN_LENGTH	96
 // #define BCM2835_SPI_MODE_BITS	(SPI_CPOL | SPI_CPHA | SPI_CS_HIGH \ x
 //				 | SPI_NO_CS | SPI_3WIRE)
 
-#define SPI_CS_CONFIG	BCM2835_SPI_CS_CS_0
+// the chip select of the port is added when a transfer is started
 #define SPI_CS_RESET	(BCM2835_SPI_CS_DONE | BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX)
-#define SPI_CS_START	(SPI_CS_CONFIG | BCM2835_SPI_CS_TA | BCM2835_SPI_CS_INTD)
+#define SPI_CS_START	(BCM2835_SPI_CS_TA | BCM2835_SPI_CS_INTD)
+#define SPI_CS_START_POLL	(BCM2835_SPI_CS_TA)
 // #define SPI_CS_DONE		(BCM2835_SPI_CS_DONE)
 // #define SPI_CS_DONE		(BCM2835_SPI_CS_DONE | BCM2835_SPI_CS_CS_1)
 #define SPI_CS_DONE		(BCM2835_SPI_CS_DONE | BCM2835_SPI_CS_CSPOL)
 
-#define SPI_MAX_TRANSFER_COUNT	8
+// size of each transfer ring, must be a power of two
+// the module parameter spi_queue_depth can only make it smaller
+#ifndef SPI_MAX_TRANSFER_COUNT
+#define SPI_MAX_TRANSFER_COUNT	16
+#endif
+
+// size of the buffer collecting received bytes for the tty
+#define RX_BATCH_MAX	256
+// size of the ring holding received bytes while the tty is throttled
+#define RX_HOLD_SIZE	4096
+// held bytes passed to the tty at once by the unthrottle
+#define RX_HOLD_CHUNK	64
+
+// one MAX3140 on each chip select of SPI0
+#define RPC_MAX_PORTS	2
+
+// completed transfers waiting for the interrupt thread, must be a power of
+// two, no transfer is started while it is full
+#define RPC_SPI_DONE_SIZE	64
+
+// records of the SPI flight recorder, must be a power of two
+#define RPC_REC_SIZE	512
+// records kept after an error before the recorder freezes
+#define RPC_REC_AFTER_ERROR	16
+
+// flags of a flight recorder record
+typedef enum {
+	// the response could not be read from the FIFO
+	RPC_REC_ERROR	= 1 << 0,
+	// the transfer had failed before and was repeated
+	RPC_REC_RETRY	= 1 << 1,
+	// the transfer was completed by polling
+	RPC_REC_POLLED	= 1 << 2,
+} rpc_rec_flags_t;
+
+// One completed SPI transfer in the flight recorder. The layout is also
+// read by userspace from the raw debugfs file, 24 bytes in host byte order.
+typedef struct {
+	// ktime_get() at completion
+	u64 ns;
+	// command word and response, 0 if it could not be read
+	u16 sent;
+	u16 rcvd;
+	// BCM2835_SPI_CS register before the transfer was acknowledged
+	u32 cs;
+	// ttyRPC index, class, transfers in the ring including this one and
+	// RPC_REC_xxx flags
+	u8 port;
+	u8 cls;
+	u8 depth;
+	u8 flags;
+	u32 pad;
+} rpc_rec_t;
+
+// state of the SPI controller when a response could not be read
+typedef struct {
+	ktime_t time;
+	u16 sent;
+	u8 port;
+	// bit 4 if the first byte was missing, bit 0 for the second
+	u8 read_err;
+	// BCM2835_SPI_CS before the transfer was acknowledged and after the
+	// FIFOs were cleared
+	u32 cs;
+	u32 cs_reset;
+} rpc_spi_error_t;
+
+// latency histograms: bucket 0 is below 1 us, bucket n counts
+// [2^(n-1), 2^n) us and the last one everything above
+#define RPC_LAT_BUCKETS	22
+
+// Stages of the RX and TX paths with a latency histogram each.
+typedef enum {
+	// GPIO interrupt of the MAX3140 until the first RdDat is started
+	RPC_LAT_RX_IRQ_TO_SPI	= 0,
+	// that RdDat until its response has been read
+	RPC_LAT_RX_SPI			= 1,
+	// response of the first byte received until it is pushed to the tty
+	RPC_LAT_RX_SPI_TO_PUSH	= 2,
+	// GPIO interrupt until the push to the tty
+	RPC_LAT_RX_IRQ_TO_PUSH	= 3,
+	// write() starting a transmission until its first WrDat is started
+	RPC_LAT_TX_WRITE_TO_SPI	= 4,
+	// first WrDat until the end of the stop bit of the last byte
+	RPC_LAT_TX_FRAME		= 5,
+	// end of the last byte until the receive mode is on the bus
+	RPC_LAT_TX_TURNAROUND	= 6,
+	// write() until the receive mode is on the bus
+	RPC_LAT_TX_TOTAL		= 7,
+	RPC_LAT_COUNT			= 8
+} rpc_lat_stage_t;
+
+typedef struct {
+	unsigned long count;
+	u64 total_ns;
+	u64 max_ns;
+	unsigned long buckets[RPC_LAT_BUCKETS];
+} rpc_lat_hist_t;
+
+struct RaspiCommPort;
+typedef struct RaspiCommPort RaspiCommPort_t;
 
-typedef void (*rpc_spi_callback_t)( uint16_t sent, uint16_t rcvd );
+typedef void (*rpc_spi_callback_t)( RaspiCommPort_t* port,
+				uint16_t sent, uint16_t rcvd );
 
 typedef struct {
 	uint16_t send_data;
 	uint16_t recv_data;
+	// send the UART config as it is when the transfer starts
+	bool current_config;
+	// id of the RX burst this read belongs to, 0 if none
+	uint8_t burst;
+	// number of times the response could not be read
+	uint8_t retries;
+	// time the transfer was queued, 0 once it has been started
+	ktime_t queued;
 	rpc_spi_callback_t callback;
 } rpc_spi_transfer_t;
 
-#define MAX_TRANSFER_COUNT	8
+// a completed transfer whose callback runs in the interrupt thread
+typedef struct {
+	RaspiCommPort_t* port;
+	rpc_spi_transfer_t t;
+	// the response could not be read, it is not decoded
+	bool failed;
+	// CPU which completed it
+	int cpu;
+} rpc_spi_done_t;
+
+// Priority classes of the transfer scheduler, lower value goes first.
+// The order inside a class is kept, so commands which depend on each
+// other must be in the same class.
+typedef enum {
+	// RS485 turnaround, the slaves may answer right after the last byte
+	RPC_SPI_CLASS_TURN	= 0,
+	// reading received data, the MAX3140 RX FIFO has only 8 words
+	RPC_SPI_CLASS_RX	= 1,
+	// transmitted data and the config and mode changes belonging to it
+	RPC_SPI_CLASS_TX	= 2,
+	// configuration changes from termios
+	RPC_SPI_CLASS_CFG	= 3,
+	RPC_SPI_CLASS_COUNT	= 4
+} rpc_spi_class_t;
+
+// result of the calibration at one SPI clock
+typedef struct {
+	unsigned int target_hz;
+	unsigned long actual_hz;
+	// RdCfg round trips, read back configs which did not match and
+	// round trips which did not complete
+	unsigned int rounds;
+	unsigned int mismatches;
+	unsigned int timeouts;
+	unsigned long fifo_errors;
+	// time from starting a transfer until its interrupt ran, without the
+	// transfer itself
+	unsigned int irq_count;
+	u64 irq_total_ns;
+	u64 irq_max_ns;
+} rpc_calib_result_t;
+
+typedef struct {
+	// ring of transfers, indices are free running and masked with
+	// rcd.transfer_mask
+	rpc_spi_transfer_t transfers[SPI_MAX_TRANSFER_COUNT];
+	unsigned int head;
+	unsigned int tail;
+	// statistics
+	unsigned int high_water;
+	unsigned long rejected;
+	unsigned long deferred;
+	unsigned long started;
+	u64 wait_total_ns;
+	u64 wait_max_ns;
+} rpc_spi_queue_t;
+
+// Transfers which are deferred if their ring is full. The command word is
+// built when the transfer is finally queued, so they never get lost.
+// The bit order is the order in which they are queued within a class.
+typedef enum {
+	// WrCfg switching the TX interrupt, class TX
+	RPC_DEFER_TX_CONFIG			= 1 << 0,
+	// WrDat enabling the RS485 driver before the first byte, class TX
+	RPC_DEFER_TRANSMIT_MODE		= 1 << 1,
+	// RdDat to continue the TX chain, class TX
+	RPC_DEFER_TX_KICK			= 1 << 2,
+	// WrDat switching to receive mode, class TURN
+	RPC_DEFER_RECEIVE_MODE		= 1 << 3,
+	// RdDat after an interrupt, class RX
+	RPC_DEFER_READ_DATA			= 1 << 4,
+	// WrCfg after a termios change, class CFG
+	RPC_DEFER_WRITE_CONFIG		= 1 << 5,
+} rpc_spi_defer_t;
 
 static void rpc_spi_cancel_transfers_and_wait(void);
-static bool rpc_spi_transfer_word( uint16_t send_data, rpc_spi_callback_t callback );
+static void rpc_spi_drop_tx_data( RaspiCommPort_t* port );
+static bool rpc_spi_transfer_word( RaspiCommPort_t* port, rpc_spi_class_t cls,
+				uint16_t send_data, rpc_spi_callback_t callback );
+static void rpc_spi_transfer_deferrable( RaspiCommPort_t* port,
+				rpc_spi_defer_t what );
+static void rpc_spi_transfer_deferrable_unlocked( RaspiCommPort_t* port,
+				rpc_spi_defer_t what );
+static void rpc_spi_set_speed( unsigned int hz );
+static void rpc_spi_update_clock_locked(void);
 
 // }}} BCM2835 SPI definitions
 //============================================================================
 // {{{ RaspiComm driver definitions
 
-typedef struct {
-	int foo;
+// State of one MAX3140, all of it belongs to this port except for the
+// transfer rings and the RX burst, those are protected by the shared spi_lock.
+struct RaspiCommPort {
+	// ttyRPC<index>
+	unsigned int index;
+	// BCM2835 chip select of the MAX3140
+	unsigned int cs;
+	// label of the interrupt GPIO
+	char irq_name[16];
 
 	// ------------------------------------------
-	// SPI variables
-	void __iomem *regs;
-	struct clk *clk;
-	int spi_irq;
-	rpc_spi_transfer_t transfers[MAX_TRANSFER_COUNT];
-	bool transfer_in_progress;
-	int transfer_count;
-	spinlock_t spi_lock;
+	// SPI transfers of this port, protected by spi_lock
+	// one transfer ring per priority class
+	rpc_spi_queue_t queues[RPC_SPI_CLASS_COUNT];
+	// RPC_DEFER_xxx bits of transfers waiting for a free slot
+	unsigned int transfer_deferred;
+	// transfers completed and bytes received, for the throughput
+	unsigned long SpiTransfers;
+	unsigned long RxBytes;
+	// transfers completed by the SPI interrupt and transfers whose
+	// response could not be read from the FIFO and were started again
+	unsigned long SpiIrqs;
+	unsigned long SpiFifoErrors;
+	// FIFO errors repeated and given up, then completed with an empty
+	// response
+	unsigned long SpiRetries;
+	unsigned long SpiGiveUps;
+	// RdCfg after a FIFO error, queued and config found different
+	bool ResyncQueued;
+	unsigned long Resyncs;
+	unsigned long ResyncMismatches;
+	// ------------------------------------------
+	// RX burst reads, protected by spi_lock
+	// number of reads queued on the next interrupt
+	unsigned int RxBurstSize;
+	// id of the current burst and of the last cancelled one
+	uint8_t RxBurstId;
+	uint8_t RxBurstCancelled;
+	// reads of the current burst still outstanding, 0 if no burst
+	unsigned int RxBurstLeft;
+	// bytes received by the current burst
+	unsigned int RxBurstReceived;
+	// an interrupt arrived during the burst
+	bool RxBurstRearm;
+	// statistics
+	unsigned long RxBursts;
+	unsigned long RxBurstReads;
+	unsigned long RxBurstBytes;
 	// ------------------------------------------
 	// MAX3140 variables
 	// transmit queue
 	queue_t TxQueue;
+	// a WrDat is queued and not yet sent, only one may be in flight
+	int TxWordQueued;
+	// a read saw T=1 while TxWordQueued was set, read again when it is sent
+	int TxKickPending;
+	// T bit of the last response, 1 if the transmit buffer was empty
+	int TxBufEmpty;
+	// TX statistics: data bytes sent, bytes sent straight from the response
+	// of the previous WrDat, SPI transfers needed for transmitting
+	unsigned long TxBytes;
+	unsigned long TxChained;
+	unsigned long TxSpiTransfers;
+	// bytes found in WrDat responses and WrCfg responses with R set
+	unsigned long RxFromWrite;
+	unsigned long RxPendingAfterConfig;
 
 	// ------------------------------------------
 	// TTY related variables
-	// the driver instance
-	struct tty_driver* tty_drv;
 	struct tty_port tty_port;
 	// currently opened tty device
 	struct tty_struct* tty_open;
 
 	// the number of open() calls
 	int tty_opened;
+	// CPU wakeup latency limit while the port is open, in us
+	struct pm_qos_request LatencyQos;
+	s32 LatencyQosUs;
+	// serializes set_termios() against close() and the port stop
+	struct mutex QosLock;
 
-	// ParityIsOdd == true ? odd : even
-	int ParityIsOdd;
-	int ParityEnabled;
+	// WrDat commands including the parity bit for the current parity mode,
+	// indexed by the data byte, points into rpc_max3140_write_cmds
+	const uint16_t* TxWriteCmds;
 
 
 	spinlock_t dev_lock;
 
-	// variable used in the delay to simulate the baudrate
+	// time of one character including start, parity and stop bits
 	ktime_t OneCharDelay;
 	struct hrtimer last_byte_sent_timer;
+	// all timers are initialized together
 	int last_byte_sent_timer_initialized;
 
+	// ------------------------------------------
+	// RS485 turnaround, protected by dev_lock
+	struct serial_rs485 Rs485;
+	// the RS485 driver is enabled, sending can start without delay
+	int Rs485DriverOn;
+	// the first byte waits for delay_rts_before_send
+	int TxHold;
+	struct hrtimer tx_start_timer;
+	// estimated end of the stop bit of the last byte, 0 if none
+	ktime_t TxFrameEnd;
+	// a transmission is running, from the first byte until the receive
+	// mode is on the bus again, tx_done is completed at its end
+	int TxActive;
+	struct completion tx_done;
+	// wakes the writers and tcdrain() outside dev_lock
+	struct work_struct tx_wakeup_work;
+	// time from the end of the last byte until receive mode is on the bus
+	unsigned long Rs485Frames;
+	u64 Rs485TurnLastNs;
+	u64 Rs485TurnTotalNs;
+	u64 Rs485TurnMaxNs;
+
+	// ------------------------------------------
+	// received bytes are collected here and passed to the tty in batches,
+	// protected by dev_lock
+	unsigned char RxBatch[RX_BATCH_MAX];
+	char RxBatchFlags[RX_BATCH_MAX];
+	unsigned int RxBatchCount;
+	struct hrtimer rx_flush_timer;
+	unsigned long RxPushes;
+	unsigned long RxPushedBytes;
+
+	// ------------------------------------------
+	// flow control, protected by dev_lock
+	// the tty is throttled, the received bytes go to RxHold, each item
+	// is the byte plus the tty flag in the upper 8 bits
+	int RxThrottled;
+	queue_t RxHold;
+	// RxHold is almost full, reading stops unless transmitting
+	int RxStalled;
+	// a read has been suppressed while stalled
+	int RxReadPending;
+	// RxHold has overflown, an overrun is reported to the tty
+	int RxHoldOverrun;
+	// output is stopped by the tty, TxPaused if a frame was in progress,
+	// it ends at the next byte so the bus is free while stopped
+	int TxStopped;
+	int TxPaused;
+	unsigned long RxThrottles;
+	unsigned long RxOverruns;
+	unsigned long TxStops;
+	// received bytes with a framing or parity error
+	unsigned long RxFrameErrors;
+	unsigned long RxParityErrors;
+
+	// ------------------------------------------
+	// polled RX mode, the RX interrupt of the MAX3140 is off and the
+	// rx_poll_timer reads the FIFO every few character times
+	int RxPolling;
+	struct hrtimer rx_poll_timer;
+	ktime_t RxPollPeriod;
+	// consecutive polls which received nothing
+	unsigned int RxPollIdle;
+	// bytes received in interrupt mode without an idle gap
+	unsigned int RxStreak;
+	ktime_t RxLastActivity;
+	// statistics
+	unsigned long RxPollEntries;
+	unsigned long RxPollExits;
+	unsigned long RxPolls;
+	unsigned long RxBytesIrq;
+	unsigned long RxBytesPolled;
+
 	// config setting of the UART
 	int UartConfig;
 
 	// struct spi_device *spi_slave;
 
-	unsigned int irqGPIO;
-	unsigned int irqNumber;
+	int irqGPIO;
+	int irqNumber;
+	// interrupts of the MAX3140, only counted by the handler
+	unsigned long GpioIrqs;
+	// SCHED_FIFO priority the interrupt thread runs at, 0 until it is set
+	int IrqThreadPrio;
+	// CPU the interrupt thread is pinned to, -1 if not pinned
+	int IrqThreadCpu;
+	// interrupts taken on another CPU than the last SPI completion, and
+	// the result of pinning the interrupt to irq_cpu
+	unsigned long GpioCrossCpu;
+	int IrqPinErr;
+
+	// ------------------------------------------
+	// latency histograms and the start times of the stages in progress,
+	// 0 if not measured, lat_lock is taken inside all other locks
+	raw_spinlock_t lat_lock;
+	rpc_lat_hist_t LatHist[RPC_LAT_COUNT];
+	ktime_t LatRxIrq;
+	ktime_t LatRxSpi;
+	ktime_t LatRxDone;
+	ktime_t LatTxWrite;
+	ktime_t LatTxSpi;
+	// the tty device of the port is registered
+	int tty_registered;
+	// debugfs/raspicomm/ttyRPC<index>
+	struct dentry* debugfs;
+};
+
+// snapshot of the counters of a port for sysfs, debugfs and TIOCGICOUNT
+typedef struct {
+	unsigned long rx;
+	unsigned long tx;
+	unsigned long frame;
+	unsigned long parity;
+	unsigned long overrun;
+	unsigned long spi_transfers;
+	unsigned long spi_irqs;
+	unsigned long spi_fifo_errors;
+	unsigned long spi_retries;
+	unsigned long spi_give_ups;
+	unsigned long resyncs;
+	unsigned long resync_mismatches;
+	unsigned long rejected;
+	unsigned int high_water;
+	unsigned long gpio_irqs;
+} rpc_port_counters_t;
+
+typedef struct {
+	int foo;
+
+	// ------------------------------------------
+	// SPI variables, shared by all ports
+	void __iomem *regs;
+	struct clk *clk;
+	int spi_irq;
+	unsigned int transfer_mask;
+	// port and class of the last started transfer, the head of that ring
+	// is in progress
+	RaspiCommPort_t* transfer_port;
+	rpc_spi_class_t transfer_class;
+	bool transfer_in_progress;
+	// the transfer in progress is polled, INTD is not set
+	bool transfer_polled;
+	// a context is running the polling loop in rpc_spi_start_transfer()
+	bool poll_active;
+	// duration of one 16 bit transfer
+	unsigned int spi_word_ns;
+	// SPI clock: rate of the core clock, requested SCLK and the divider
+	// for it, the divider is written before the next transfer if dirty
+	unsigned long core_hz;
+	unsigned int spi_target_hz;
+	unsigned int spi_cdiv;
+	bool spi_cdiv_dirty;
+	struct notifier_block clk_nb;
+	bool clk_nb_registered;
+	// highest SCLK allowed by the MAX3140 and the device tree
+	unsigned int spi_max_hz;
+	raw_spinlock_t spi_lock;
+	// threaded mode: the interrupt completes the transfers and the thread
+	// calls their callbacks from this ring, protected by spi_lock
+	bool threaded;
+	void* spi_irq_dev;
+	rpc_spi_done_t done[RPC_SPI_DONE_SIZE];
+	unsigned int done_head;
+	unsigned int done_tail;
+	// SCHED_FIFO priority the SPI interrupt thread runs at and the CPU it
+	// is pinned to, -1 if not pinned
+	int spi_thread_prio;
+	int spi_thread_cpu;
+	// CPU the interrupts and the timers are pinned to, -1 if not pinned,
+	// and the result of pinning the SPI interrupt
+	int irq_cpu;
+	int spi_irq_pin_err;
+	// CPU which started the transfer in progress and the one which
+	// completed the last transfer
+	int transfer_cpu;
+	int complete_cpu;
+	// transfers completed on another CPU than they were started on, and
+	// callbacks run by the thread on another CPU than the completion
+	unsigned long spi_cross_cpu;
+	unsigned long callback_cross_cpu;
+	// completion statistics
+	unsigned long transfers_polled;
+	unsigned long transfers_irq;
+	unsigned long poll_timeouts;
+	// watchdog of the transfers completed by the interrupt, it runs while
+	// one is in progress and is pushed out by each start
+	struct hrtimer spi_watchdog;
+	bool spi_watchdog_armed;
+	ktime_t spi_watchdog_deadline;
+	// interrupts lost, the transfer was done, and transfers which did
+	// not finish and were started again
+	unsigned long spi_lost_irqs;
+	unsigned long spi_stall_resets;
+	// transfers whose response could not be read from the FIFO
+	unsigned long fifo_errors;
+	// FIFO error recovery: SCLK set by spi_speed_hz or the calibration,
+	// the clock is halved when the errors pile up and raised again after
+	// a quiet period
+	unsigned int spi_nominal_hz;
+	ktime_t err_window;
+	unsigned int err_window_count;
+	ktime_t err_last;
+	unsigned long spi_downshifts;
+	unsigned long spi_upshifts;
+	rpc_spi_error_t spi_errors[RPC_SPI_ERROR_SNAPSHOTS];
+	unsigned int spi_error_head;
+	// debugfs/raspicomm
+	struct dentry* debugfs;
+
+	// ------------------------------------------
+	// flight recorder of the last SPI transfers, only written when a
+	// transfer completes, which spi_lock serializes already
+	rpc_rec_t rec[RPC_REC_SIZE];
+	// free running index of the next record
+	unsigned int rec_head;
+	// an error stops the recording RPC_REC_AFTER_ERROR records later
+	bool rec_stopping;
+	unsigned int rec_stop_at;
+	bool rec_frozen;
+	struct debugfs_blob_wrapper rec_blob;
+
+	// ------------------------------------------
+	// SPI calibration, only one runs at a time
+	struct mutex calib_lock;
+	// transfers are not polled while calibrating, so the interrupt
+	// latency can be measured
+	bool calibrating;
+	// result of the step running, protected by spi_lock
+	rpc_calib_result_t* calib_cur;
+	// start of the transfer in progress, 0 if not measured
+	ktime_t calib_t0;
+	// response of the last RdCfg round trip
+	struct completion calib_done;
+	uint16_t calib_rcvd;
+	// results of the last calibration
+	rpc_calib_result_t calib[RPC_CALIB_STEPS];
+	unsigned int calib_steps;
+	unsigned int calib_selected_hz;
+	unsigned int calib_safe_baud;
+
+	// ------------------------------------------
+	// the driver instance, one line per port
+	struct tty_driver* tty_drv;
+	// the ports in the order of their tty index
+	RaspiCommPort_t* ports[RPC_MAX_PORTS];
+	unsigned int port_count;
 } RaspiCommData_t;
 
 static RaspiCommData_t rcd = { 0, };
 
+// WrDat commands for all bytes, one table for each Parity value
+static uint16_t rpc_max3140_write_cmds[3][QUEUE_MAP_SIZE];
+
 // }}} RaspiComm driver definitions
 //============================================================================
+// {{{ module parameters
+
+static unsigned int spi_queue_depth = SPI_MAX_TRANSFER_COUNT;
+module_param( spi_queue_depth, uint, 0444 );
+MODULE_PARM_DESC( spi_queue_depth, "depth of the SPI transfer ring, "
+		"rounded down to a power of two (2.."
+		__stringify(SPI_MAX_TRANSFER_COUNT) ")" );
+
+static unsigned int spi_speed_hz = SPI_DEFAULT_HZ;
+module_param( spi_speed_hz, uint, 0444 );
+MODULE_PARM_DESC( spi_speed_hz, "target SPI clock in Hz (up to "
+		__stringify(MAX3140_SCLK_MAX_HZ) "), the divider is calculated "
+		"from the core clock" );
+
+static bool spi_calibrate = false;
+module_param( spi_calibrate, bool, 0444 );
+MODULE_PARM_DESC( spi_calibrate, "calibrate the SPI clock when the driver "
+		"is loaded, the fastest reliable one is used instead of "
+		"spi_speed_hz" );
+
+static unsigned int spi_retry_max = 3;
+module_param( spi_retry_max, uint, 0644 );
+MODULE_PARM_DESC( spi_retry_max, "repeat a transfer whose response could "
+		"not be read up to this many times, only a RdCfg is repeated" );
+
+static unsigned int spi_downshift_errors = 8;
+module_param( spi_downshift_errors, uint, 0644 );
+MODULE_PARM_DESC( spi_downshift_errors, "halve the SPI clock after this "
+		"many FIFO errors within one second, 0 keeps the clock" );
+
+static unsigned int spi_downshift_quiet_ms = 10000;
+module_param( spi_downshift_quiet_ms, uint, 0644 );
+MODULE_PARM_DESC( spi_downshift_quiet_ms, "double a lowered SPI clock "
+		"again after this many ms without FIFO error" );
+
+static unsigned int spi_poll_limit_us = BCM2835_SPI_POLLING_LIMIT_US;
+module_param( spi_poll_limit_us, uint, 0644 );
+MODULE_PARM_DESC( spi_poll_limit_us, "complete SPI transfers by polling "
+		"while the expected time of a chain stays below this many us, "
+		"0 always uses the interrupt" );
+
+static unsigned int rx_burst_max = 4;
+module_param( rx_burst_max, uint, 0644 );
+MODULE_PARM_DESC( rx_burst_max, "maximum number of RdDat commands queued "
+		"back to back on an interrupt (1..8), 1 reads one word at a time" );
+
+static unsigned int rx_poll_enter = 32;
+module_param( rx_poll_enter, uint, 0644 );
+MODULE_PARM_DESC( rx_poll_enter, "switch to polled RX mode after this many "
+		"bytes received without an idle gap, 0 never polls" );
+
+static unsigned int rx_poll_interval = 4;
+module_param( rx_poll_interval, uint, 0644 );
+MODULE_PARM_DESC( rx_poll_interval, "character times between two polls of "
+		"the RX FIFO in polled mode (1..7)" );
+
+static unsigned int rx_poll_exit = 2;
+module_param( rx_poll_exit, uint, 0644 );
+MODULE_PARM_DESC( rx_poll_exit, "return to interrupt mode after this many "
+		"polls without data" );
+
+static bool tx_chain = true;
+module_param( tx_chain, bool, 0644 );
+MODULE_PARM_DESC( tx_chain, "send the next byte right after a WrDat whose "
+		"response reports an empty transmit buffer" );
+
+static unsigned int rx_batch_size = 64;
+module_param( rx_batch_size, uint, 0644 );
+MODULE_PARM_DESC( rx_batch_size, "pass received bytes to the tty when this "
+		"many are collected (1..256)" );
+
+static unsigned int rx_flush_chars = 2;
+module_param( rx_flush_chars, uint, 0644 );
+MODULE_PARM_DESC( rx_flush_chars, "pass received bytes to the tty at the "
+		"latest this many character times after the first one" );
+
+static unsigned int tx_queue_size = 4096;
+module_param( tx_queue_size, uint, 0444 );
+MODULE_PARM_DESC( tx_queue_size, "size of the transmit queue in characters, "
+		"rounded down to a power of two (256..65536)" );
+
+#if defined(CONFIG_PREEMPT_RT_FULL) || defined(CONFIG_PREEMPT_RT)
+static bool irq_threaded = true;
+#else
+static bool irq_threaded = false;
+#endif
+module_param( irq_threaded, bool, 0444 );
+MODULE_PARM_DESC( irq_threaded, "call the SPI callbacks and read received "
+		"bytes in interrupt threads, the default on PREEMPT_RT kernels" );
+
+static int irq_thread_prio = 50;
+module_param( irq_thread_prio, int, 0644 );
+MODULE_PARM_DESC( irq_thread_prio, "SCHED_FIFO priority of the interrupt "
+		"threads (1..99), from kernel 5.9 on only 1 and 50 are possible, "
+		"other values are rounded down to one of them" );
+
+static int irq_cpu = -1;
+module_param( irq_cpu, int, 0444 );
+MODULE_PARM_DESC( irq_cpu, "CPU for the SPI and MAX3140 interrupts and the "
+		"timers, -1 leaves them to the kernel" );
+
+static bool irq_cpu_exclusive = false;
+module_param( irq_cpu_exclusive, bool, 0644 );
+MODULE_PARM_DESC( irq_cpu_exclusive, "pin the interrupt threads to irq_cpu "
+		"as well" );
+
+static unsigned int rx_qos_percent = 25;
+module_param( rx_qos_percent, uint, 0644 );
+MODULE_PARM_DESC( rx_qos_percent, "limit the CPU wakeup latency to this "
+		"percentage of the time the receive FIFO takes to fill while a port "
+		"is open, 0 disables the limit" );
+
+// }}} module parameters
+//============================================================================
 // {{{ raspicomm private functions
 
 static unsigned char rpc_max3140_get_baudrate_index( speed_t speed );
-static void rpc_max3140_configure( speed_t speed,
+static void rpc_max3140_configure( RaspiCommPort_t* port, speed_t speed,
 				Databits databits, Stopbits stopbits, Parity parity );
-static void raspicomm_rs485_received( struct tty_struct* tty, int c );
+static void raspicomm_rs485_received( RaspiCommPort_t* port,
+				struct tty_struct* tty, int c );
+static void rpc_rx_flush( RaspiCommPort_t* port );
+static enum hrtimer_restart rx_flush_timer_expired( struct hrtimer *timer );
 static irqreturn_t raspicomm_irq_handler( int irq, void* dev_id );
-static int rpc_max3140_make_write_data_cmd( int n );
+static irqreturn_t raspicomm_irq_hard( int irq, void* dev_id );
+static irqreturn_t raspicomm_irq_thread( int irq, void* dev_id );
+static void rpc_max3140_init_write_cmds(void);
+static void rpc_max3140_read_data( RaspiCommPort_t* port );
+static void rpc_port_qos_remove( RaspiCommPort_t* port );
+// attributes of the tty device of each port
+static const struct attribute_group* rpc_port_groups[2];
 
 // }}} raspicomm private functions
 //============================================================================
@@ -360,6 +1021,7 @@ static int rpc_tty_write( struct tty_struct *,
 static int rpc_tty_write_room( struct tty_struct * );
 static void rpc_tty_flush_buffer( struct tty_struct * );
 static int rpc_tty_chars_in_buffer( struct tty_struct * );
+static void rpc_tty_wait_until_sent( struct tty_struct *, int );
 static void rpc_tty_set_termios( struct tty_struct *,
 				struct ktermios * );
 static void rpc_tty_stop( struct tty_struct * );
@@ -370,6 +1032,8 @@ static int rpc_tty_tiocmset( struct tty_struct *tty,
 				unsigned int set, unsigned int clear );
 static int rpc_tty_ioctl( struct tty_struct* tty,
 				unsigned int cmd, unsigned int long arg );
+static int rpc_tty_get_icount( struct tty_struct* tty,
+				struct serial_icounter_struct* icount );
 static void rpc_tty_throttle( struct tty_struct * tty );
 static void rpc_tty_unthrottle( struct tty_struct * tty );
 
@@ -384,7 +1048,9 @@ static const struct tty_operations raspicomm_ops = {
 	.write_room			= rpc_tty_write_room,
 	.flush_buffer		= rpc_tty_flush_buffer,
 	.chars_in_buffer	= rpc_tty_chars_in_buffer,
+	.wait_until_sent	= rpc_tty_wait_until_sent,
 	.ioctl				= rpc_tty_ioctl,
+	.get_icount		= rpc_tty_get_icount,
 	.set_termios		= rpc_tty_set_termios,
 	.stop				= rpc_tty_stop,
 	.start				= rpc_tty_start,
@@ -396,12 +1062,186 @@ static const struct tty_operations raspicomm_ops = {
 };
 
 #define IRQ_DEV_NAME "raspicomm"
-#define PORT_COUNT 1
 
 // }}} private fields
 //============================================================================
+// {{{ latency histograms
+
+// names of the stages in debugfs
+static const char* const rpc_lat_names[RPC_LAT_COUNT] = {
+	"rx_irq_to_spi",
+	"rx_spi",
+	"rx_spi_to_push",
+	"rx_irq_to_push",
+	"tx_write_to_spi",
+	"tx_frame",
+	"tx_turnaround",
+	"tx_total",
+};
+
+/* Add the time from start to end to the histogram of a stage, lat_lock
+ * must be held.
+ */
+static void rpc_lat_add( RaspiCommPort_t* port, rpc_lat_stage_t stage,
+				ktime_t start, ktime_t end )
+{
+	rpc_lat_hist_t* h = &port->LatHist[stage];
+	s64 ns = ktime_to_ns( ktime_sub( end, start ) );
+	u64 us;
+
+	if( ns < 0 )
+	{
+		ns = 0;
+	}
+	us = div_u64( ns, NSEC_PER_USEC );
+	h->count++;
+	h->total_ns += ns;
+	h->max_ns = max_t( u64, h->max_ns, ns );
+	h->buckets[min_t( unsigned int, fls64( us ), RPC_LAT_BUCKETS - 1 )]++;
+}
+
+/* RX: the GPIO interrupt starts the measurement unless one is running.
+ */
+static void rpc_lat_rx_irq( RaspiCommPort_t* port )
+{
+	unsigned long spinlock_flags;
+
+	raw_spin_lock_irqsave( &port->lat_lock, spinlock_flags );
+	if( !port->LatRxIrq )
+	{
+		port->LatRxIrq = ktime_get();
+	}
+	raw_spin_unlock_irqrestore( &port->lat_lock, spinlock_flags );
+}
+
+/* A transfer of the port has been started for the first time, spi_lock
+ * must be held. The first RdDat after the interrupt and the first WrDat
+ * sending a byte end the stages waiting for them.
+ */
+static void rpc_lat_spi_started( RaspiCommPort_t* port, uint16_t data,
+				ktime_t now )
+{
+	uint16_t cmd = data & MAX3140_CMD_WRITE_CONFIG;
+
+	raw_spin_lock( &port->lat_lock );
+	if( cmd == MAX3140_CMD_READ_DATA && port->LatRxIrq &&
+			!port->LatRxSpi && !port->LatRxDone )
+	{
+		rpc_lat_add( port, RPC_LAT_RX_IRQ_TO_SPI, port->LatRxIrq, now );
+		port->LatRxSpi = now;
+	}
+	else if( cmd == MAX3140_CMD_WRITE_DATA &&
+			!(data & MAX3140_WRDAT_DO_NOT_TRANSMIT) &&
+			port->LatTxWrite && !port->LatTxSpi )
+	{
+		rpc_lat_add( port, RPC_LAT_TX_WRITE_TO_SPI, port->LatTxWrite, now );
+		port->LatTxSpi = now;
+	}
+	raw_spin_unlock( &port->lat_lock );
+}
+
+/* A transfer of the port is done, spi_lock must be held. If the measured
+ * RdDat received nothing the interrupt was not for received data.
+ */
+static void rpc_lat_spi_done( RaspiCommPort_t* port, uint16_t send_data,
+				uint16_t recv_data, ktime_t now )
+{
+	raw_spin_lock( &port->lat_lock );
+	if( port->LatRxSpi &&
+			(send_data & MAX3140_CMD_WRITE_CONFIG) == MAX3140_CMD_READ_DATA )
+	{
+		rpc_lat_add( port, RPC_LAT_RX_SPI, port->LatRxSpi, now );
+		port->LatRxSpi = 0;
+		if( recv_data & MAX3140_RECEIVE_BUFFER_FULL )
+		{
+			port->LatRxDone = now;
+		}
+		else if( !port->LatRxDone )
+		{
+			port->LatRxIrq = 0;
+		}
+	}
+	raw_spin_unlock( &port->lat_lock );
+}
+
+/* The received bytes have been pushed to the tty.
+ */
+static void rpc_lat_rx_pushed( RaspiCommPort_t* port )
+{
+	unsigned long spinlock_flags;
+	ktime_t now;
+
+	raw_spin_lock_irqsave( &port->lat_lock, spinlock_flags );
+	if( port->LatRxDone )
+	{
+		now = ktime_get();
+		rpc_lat_add( port, RPC_LAT_RX_SPI_TO_PUSH, port->LatRxDone, now );
+		rpc_lat_add( port, RPC_LAT_RX_IRQ_TO_PUSH, port->LatRxIrq, now );
+		port->LatRxIrq = 0;
+		port->LatRxDone = 0;
+	}
+	raw_spin_unlock_irqrestore( &port->lat_lock, spinlock_flags );
+}
+
+/* TX: a write() starts a transmission unless one is measured already.
+ */
+static void rpc_lat_tx_write( RaspiCommPort_t* port )
+{
+	unsigned long spinlock_flags;
+
+	raw_spin_lock_irqsave( &port->lat_lock, spinlock_flags );
+	if( !port->LatTxWrite )
+	{
+		port->LatTxWrite = ktime_get();
+	}
+	raw_spin_unlock_irqrestore( &port->lat_lock, spinlock_flags );
+}
+
+/* The last byte leaves the MAX3140 at frame_end.
+ */
+static void rpc_lat_tx_last_byte( RaspiCommPort_t* port, ktime_t frame_end )
+{
+	unsigned long spinlock_flags;
+
+	raw_spin_lock_irqsave( &port->lat_lock, spinlock_flags );
+	if( port->LatTxSpi )
+	{
+		rpc_lat_add( port, RPC_LAT_TX_FRAME, port->LatTxSpi, frame_end );
+		port->LatTxSpi = 0;
+	}
+	raw_spin_unlock_irqrestore( &port->lat_lock, spinlock_flags );
+}
+
+/* The receive mode is on the bus again, the transmission is over.
+ */
+static void rpc_lat_tx_done( RaspiCommPort_t* port, ktime_t frame_end,
+				ktime_t now )
+{
+	unsigned long spinlock_flags;
+
+	raw_spin_lock_irqsave( &port->lat_lock, spinlock_flags );
+	rpc_lat_add( port, RPC_LAT_TX_TURNAROUND, frame_end, now );
+	if( port->LatTxWrite )
+	{
+		rpc_lat_add( port, RPC_LAT_TX_TOTAL, port->LatTxWrite, now );
+	}
+	port->LatTxWrite = 0;
+	port->LatTxSpi = 0;
+	raw_spin_unlock_irqrestore( &port->lat_lock, spinlock_flags );
+}
+
+// }}} latency histograms
+//============================================================================
 // {{{ spi functions
 
+/* Mode to start a timer with. While the interrupts are pinned the timers
+ * are pinned to the CPU starting them, most are started by the interrupts.
+ */
+static inline enum hrtimer_mode rpc_hrtimer_mode( enum hrtimer_mode mode )
+{
+	return READ_ONCE( rcd.irq_cpu ) >= 0 ? mode | HRTIMER_MODE_PINNED : mode;
+}
+
 static void log_max3140_message( int tx, int rx, int err )
 {
 	char buffer[256];
@@ -462,21 +1302,165 @@ static void log_max3140_message( int tx, int rx, int err )
 	}
 }
 
-static void start_transmitting_done( uint16_t send_data, uint16_t recv_data )
+static void irq_msg_write_done( RaspiCommPort_t* port,
+				uint16_t send_data, uint16_t recv_data );
+
+/* Wake the writers and tcdrain() of the port. The line discipline may
+ * write again from the wakeup, so it must not run under dev_lock.
+ */
+static void rpc_tx_wakeup_work( struct work_struct* work )
 {
-	LOG( "start_transmitting_done" );
-	// rpc_spi_msg2_rx( context, &rxdata, NULL );
-	if( recv_data & MAX3140_RECEIVE_BUFFER_FULL )
+	RaspiCommPort_t* port =
+			container_of( work, RaspiCommPort_t, tx_wakeup_work );
+
+	tty_port_tty_wakeup( &port->tty_port );
+}
+
+/* Queue a WrDat for the next byte of the TX queue, dev_lock must be held,
+ * the TX interrupt must be on and no other WrDat may be queued.
+ * Returns 0 if the queue is empty.
+ */
+static int rpc_max3140_tx_send_next( RaspiCommPort_t* port )
+{
+	uint16_t send_data;
+	int count;
+	int rc;
+
+	// the queue holds encoded commands, they are sent as they are
+	rc = queue_peek( &port->TxQueue, &send_data );
+	if( rc )
+	{
+		if( rpc_spi_transfer_word( port, RPC_SPI_CLASS_TX,
+					send_data, irq_msg_write_done ) )
+		{
+			// the byte is on its way, remove it from the queue
+			queue_dequeue( &port->TxQueue, &send_data );
+			port->TxWordQueued = 1;
+			count = queue_get_count( &port->TxQueue );
+			if( count == port->TxQueue.size / 2 || count == 0 )
+			{
+				// half of the queue is free again, let a blocked
+				// write() go on; when it is empty chars_in_buffer()
+				// has dropped to the byte in flight
+				schedule_work( &port->tx_wakeup_work );
+			}
+		}
+		else
+		{
+			// transfer ring is full, read again later which
+			// sends the byte as soon as there is room
+			rpc_spi_transfer_deferrable( port, RPC_DEFER_TX_KICK );
+		}
+	}
+	return rc;
+}
+
+/* Start a transmission, dev_lock must be held and the TX interrupt must be
+ * off.
+ */
+static void rpc_max3140_tx_start( RaspiCommPort_t* port )
+{
+	LOG( "starting transfer" );
+	port->UartConfig |= MAX3140_CFG_ENABLE_TX_INT;
+	rpc_spi_transfer_deferrable( port, RPC_DEFER_TX_CONFIG );
+	// cancel a pending EOT, if it is running already it sees the
+	// TX interrupt on and keeps the driver enabled
+	hrtimer_try_to_cancel( &port->last_byte_sent_timer );
+	port->TxFrameEnd = 0;
+	if( !port->TxActive )
+	{
+		port->TxActive = 1;
+		reinit_completion( &port->tx_done );
+	}
+	rpc_lat_tx_write( port );
+	if( !port->Rs485DriverOn && port->Rs485.delay_rts_before_send )
+	{
+		// enable the driver and wait before the first byte
+		port->TxHold = 1;
+		rpc_spi_transfer_deferrable( port, RPC_DEFER_TRANSMIT_MODE );
+		hrtimer_start( &port->tx_start_timer,
+				ms_to_ktime( port->Rs485.delay_rts_before_send ),
+				rpc_hrtimer_mode( HRTIMER_MODE_REL ) );
+	}
+	else
+	{
+		// send the first byte, a full transfer ring defers it
+		rpc_max3140_tx_send_next( port );
+	}
+	port->Rs485DriverOn = 1;
+}
+
+/* A WrDat of the TX chain has been sent. If its response reports an empty
+ * transmit buffer the next byte is sent right away, else the TX interrupt
+ * continues the chain. The end of the transmission is always detected by
+ * a read, the last byte may still be in the buffer here.
+ */
+static void rpc_max3140_tx_word_sent( RaspiCommPort_t* port,
+				uint16_t recv_data )
+{
+	unsigned long spinlock_flags;
+	int kick;
+
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	port->TxWordQueued = 0;
+	port->TxBytes++;
+	kick = port->TxKickPending;
+	port->TxKickPending = 0;
+	if( port->TxPaused )
+	{
+		// the output is stopped, a read ends the frame
+		kick = kick || (recv_data & MAX3140_TRANSMIT_BUF_EMPTY);
+	}
+	else if( tx_chain && (recv_data & MAX3140_TRANSMIT_BUF_EMPTY) &&
+			(port->UartConfig & MAX3140_CFG_ENABLE_TX_INT) &&
+			!queue_is_empty( &port->TxQueue ) )
+	{
+		rpc_max3140_tx_send_next( port );
+		port->TxChained++;
+		kick = 0;
+	}
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	if( kick )
+	{
+		// a read saw an empty transmit buffer meanwhile, check again
+		rpc_spi_transfer_deferrable( port, RPC_DEFER_TX_KICK );
+	}
+}
+
+/* Decode the response of every completed transfer before its callback.
+ * Both data commands clock out a received byte if R is set, it is passed to
+ * the tty here. The config commands only report R, in that case the data
+ * is fetched with a read.
+ */
+static void rpc_max3140_response( RaspiCommPort_t* port,
+				uint16_t send_data, uint16_t recv_data )
+{
+	port->TxBufEmpty = (recv_data & MAX3140_TRANSMIT_BUF_EMPTY) != 0;
+	if( !(recv_data & MAX3140_RECEIVE_BUFFER_FULL) )
+	{
+		return;
+	}
+	port->RxBytes++;
+	switch( send_data & MAX3140_CMD_WRITE_CONFIG )
 	{
-		// data is available in the receive register
-		// handle the received data
-		raspicomm_rs485_received( rcd.tty_open, recv_data );
-		LOG( "start_transmitting_done recv: 0x%X", recv_data );
+		case MAX3140_CMD_WRITE_DATA:
+			port->RxFromWrite++;
+			// fall through
+		case MAX3140_CMD_READ_DATA:
+			// data is available in the receive register
+			// handle the received data
+			raspicomm_rs485_received( port, port->tty_open, recv_data );
+			break;
+		default:
+			port->RxPendingAfterConfig++;
+			rpc_max3140_read_data( port );
+			break;
 	}
 }
 
 #if 0
-static void start_transmitting_done2( uint16_t send_data, uint16_t recv_data )
+static void start_transmitting_done2( RaspiCommPort_t* port,
+				uint16_t send_data, uint16_t recv_data )
 {
 	LOG( "start_transmitting_done2" );
 }
@@ -484,132 +1468,457 @@ static void start_transmitting_done2( uint16_t send_data, uint16_t recv_data )
 #define start_transmitting_done2 0
 #endif
 
-#if 0
-static void irq_msg_write_done( uint16_t send_data, uint16_t recv_data )
+static void irq_msg_write_done( RaspiCommPort_t* port,
+				uint16_t send_data, uint16_t recv_data )
 {
 	LOG( "irq_msg_write_done" );
-	// nothing to do here
+	rpc_max3140_tx_word_sent( port, recv_data );
 }
-#else
-#define irq_msg_write_done 0
-#endif
 
-static void irq_msg_read_done( uint16_t send_data, uint16_t recv_data )
+/* Handle the response of a RdDat, the received byte has already been passed
+ * to the tty by rpc_max3140_response(). Send the next byte if the transmit
+ * buffer is empty.
+ * Returns true if a byte has been received or sent, which means the irq pin
+ * has to be checked again.
+ */
+static bool rpc_max3140_read_response( RaspiCommPort_t* port,
+				uint16_t recv_data )
 {
 	unsigned long spinlock_flags;
-	// int rxdata, txdata, rc, irqstate = 1;
-	uint8_t byte;
+	ktime_t expires = 0;
 	int rc;
-	int irqstate = 1;
+	bool again = false;
 
-	LOG( "irq_msg_read_done" );
-	// recv_data = rpc_spi_msg_rx( context );
 	if( recv_data & MAX3140_RECEIVE_BUFFER_FULL )
 	{
-		// data is available in the receive register
-		// handle the received data
-		raspicomm_rs485_received( rcd.tty_open, recv_data );
-		irqstate = gpio_get_value( rcd.irqGPIO );
-		LOG( "irq_msg_read_done recv: 0x%X irq=%d", recv_data, irqstate );
+		again = true;
+		LOG( "irq_msg_read_done recv: 0x%X", recv_data );
 	}
 	if( recv_data & MAX3140_TRANSMIT_BUF_EMPTY )
 	{
 		// there is space in the transmit buffer
-		spin_lock_irqsave( &rcd.dev_lock, spinlock_flags );
-		if( rcd.UartConfig & MAX3140_CFG_ENABLE_TX_INT )
+		spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+		if( !(port->UartConfig & MAX3140_CFG_ENABLE_TX_INT) )
+		{
+			// transmit interrupt is off, nothing to do
+			// prevent timer from starting
+			rc = 1;
+		}
+		else if( port->TxWordQueued )
+		{
+			// the previous byte is still queued, T refers to the one
+			// before, check again after it has been sent
+			port->TxKickPending = 1;
+			rc = 1;
+		}
+		else if( port->TxHold )
+		{
+			// the driver is enabled but delay_rts_before_send is not
+			// over yet, tx_start_delay_done() sends the first byte
+			rc = 1;
+		}
+		else if( port->TxPaused )
+		{
+			// the output is stopped, end the frame like an empty queue
+			// so the peer can send XON, rpc_tty_start() begins a new one
+			WRITE_ONCE( port->UartConfig,
+					port->UartConfig & ~MAX3140_CFG_ENABLE_TX_INT );
+			rpc_spi_transfer_deferrable( port, RPC_DEFER_TX_CONFIG );
+			rc = 0;
+		}
+		else
 		{
 			// transmit interrupt is on, this means we have to check the queue
-			rc = queue_dequeue( &rcd.TxQueue, &byte );
+			rc = rpc_max3140_tx_send_next( port );
 			if( rc )
 			{
-				send_data = rpc_max3140_make_write_data_cmd( byte );
-				irqstate = 1;
+				again = false;
 			}
 			else
 			{
 				// no more data to send, disable transmit interrupt
-				rcd.UartConfig &= ~MAX3140_CFG_ENABLE_TX_INT;
-				send_data = rcd.UartConfig;
+				WRITE_ONCE( port->UartConfig,
+						port->UartConfig & ~MAX3140_CFG_ENABLE_TX_INT );
+				// pairs with the barrier in rpc_tty_write(), a writer
+				// that still saw the interrupt on has its bytes seen here
+				smp_mb();
+				if( !queue_is_empty( &port->TxQueue ) )
+				{
+					port->UartConfig |= MAX3140_CFG_ENABLE_TX_INT;
+					rc = rpc_max3140_tx_send_next( port );
+				}
+				else
+				{
+					rpc_spi_transfer_deferrable( port, RPC_DEFER_TX_CONFIG );
+				}
 			}
-			rpc_spi_transfer_word( send_data, irq_msg_write_done );
 		}
-		else
+		if( !rc )
 		{
-			// transmit interrupt is off, nothing to do
-			// prevent timer from starting
-			rc = 1;
+			// T confirms that the last byte has left the transmit
+			// buffer, it is in the shift register now and done after
+			// one character time at the latest
+			port->TxFrameEnd = ktime_add( ktime_get(), port->OneCharDelay );
+			rpc_lat_tx_last_byte( port, port->TxFrameEnd );
+			expires = ktime_add_ms( port->TxFrameEnd,
+					port->Rs485.delay_rts_after_send );
 		}
-		spin_unlock_irqrestore( &rcd.dev_lock, spinlock_flags );
+		spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
 		if( !rc )
 		{
 			// after the last byte has been sent the transmission is finished
 			LOG( "start HR timer last_byte_sent_timer" );
-			hrtimer_start( &rcd.last_byte_sent_timer, rcd.OneCharDelay,
-						HRTIMER_MODE_REL );
+			hrtimer_start( &port->last_byte_sent_timer, expires,
+						rpc_hrtimer_mode( HRTIMER_MODE_ABS ) );
 		}
 	}
-	if( !irqstate )
+	return again;
+}
+
+static void irq_msg_read_done( RaspiCommPort_t* port,
+				uint16_t send_data, uint16_t recv_data )
+{
+	LOG( "irq_msg_read_done" );
+	// recv_data = rpc_spi_msg_rx( context );
+	if( rpc_max3140_read_response( port, recv_data ) &&
+			!gpio_get_value( port->irqGPIO ) )
 	{
 		// irq pin is still low, read again
-		rpc_spi_transfer_word( MAX3140_CMD_READ_DATA, irq_msg_read_done );
+		rpc_max3140_read_data( port );
+	}
+	else
+	{
+		rpc_rx_flush( port );
 	}
 }
 
-#if 0
-static void stop_transmitting_done( uint16_t send_data, uint16_t recv_data )
+static enum hrtimer_restart rx_poll_timer_expired( struct hrtimer *timer )
 {
-	LOG( "stop_transmitting_done" );
-	// nothing to do here
+	RaspiCommPort_t* port = container_of( timer, RaspiCommPort_t, rx_poll_timer );
+
+	if( !READ_ONCE(port->RxPolling) )
+	{
+		return HRTIMER_NORESTART;
+	}
+	port->RxPolls++;
+	rpc_max3140_read_data( port );
+	hrtimer_forward_now( timer, port->RxPollPeriod );
+	return HRTIMER_RESTART;
 }
-#else
-#define stop_transmitting_done 0
-#endif
 
-static enum hrtimer_restart last_byte_sent( struct hrtimer *timer )
+/* Switch to polled RX mode: turn the RX interrupt of the MAX3140 off and
+ * read the FIFO from the rx_poll_timer.
+ */
+static void rpc_max3140_rx_poll_enter( RaspiCommPort_t* port )
 {
-	LOG( "last_byte_sent" );
-	rpc_spi_transfer_word( MAX3140_CMD_RECEIVE_MODE, stop_transmitting_done );
-	return HRTIMER_NORESTART;
+	unsigned long spinlock_flags;
+	unsigned int interval;
+	ktime_t period;
+
+	interval = clamp_t( unsigned int, rx_poll_interval, 1, 7 );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	if( port->RxPolling || (port->UartConfig & MAX3140_BLOCK_COMMUNICATION) )
+	{
+		spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+		return;
+	}
+	port->RxPolling = 1;
+	port->RxPollIdle = 0;
+	port->UartConfig &= ~MAX3140_CFG_ENABLE_RX_INT;
+	period = ktime_set( 0, ktime_to_ns( port->OneCharDelay ) * interval );
+	port->RxPollPeriod = period;
+	port->RxPollEntries++;
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	LOG( "rx polled mode, period %d us", (int)ktime_to_us(period) );
+
+	rpc_spi_transfer_deferrable( port, RPC_DEFER_WRITE_CONFIG );
+	hrtimer_start( &port->rx_poll_timer, period,
+			rpc_hrtimer_mode( HRTIMER_MODE_REL ) );
 }
 
-#if 0
-static void configure_uart_done( uint16_t send_data, uint16_t recv_data )
+/* Back to interrupt mode, the timer stops itself. The MAX3140 raises the
+ * interrupt as soon as it is on if there is data in the FIFO.
+ */
+static void rpc_max3140_rx_poll_exit( RaspiCommPort_t* port )
 {
-	LOG( "configure_uart_done" );
-	// nothing to do here
+	unsigned long spinlock_flags;
+
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	if( !port->RxPolling )
+	{
+		spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+		return;
+	}
+	port->RxPolling = 0;
+	port->RxStreak = 0;
+	port->UartConfig |= MAX3140_CFG_ENABLE_RX_INT;
+	port->RxPollExits++;
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	LOG( "rx interrupt mode" );
+
+	rpc_spi_transfer_deferrable( port, RPC_DEFER_WRITE_CONFIG );
 }
-#else
-#define configure_uart_done 0
-#endif
+
+/* Decide about the RX mode after a burst which received 'bytes' bytes.
+ * Sustained traffic switches to polled mode, an idle line back to the
+ * interrupt.
+ */
+static void rpc_max3140_rx_mode_update( RaspiCommPort_t* port,
+				unsigned int bytes )
+{
+	ktime_t now;
+
+	if( READ_ONCE(port->RxPolling) )
+	{
+		port->RxBytesPolled += bytes;
+		if( bytes > 0 )
+		{
+			port->RxPollIdle = 0;
+		}
+		else if( ++port->RxPollIdle >= rx_poll_exit )
+		{
+			rpc_max3140_rx_poll_exit( port );
+		}
+		return;
+	}
+	port->RxBytesIrq += bytes;
+	if( bytes == 0 || rx_poll_enter == 0 )
+	{
+		return;
+	}
+	now = ktime_get();
+	if( ktime_to_ns( ktime_sub( now, port->RxLastActivity ) ) >
+			ktime_to_ns( port->OneCharDelay ) *
+			clamp_t( unsigned int, rx_poll_interval, 1, 7 ) )
+	{
+		// the line was idle in between, start counting again
+		port->RxStreak = 0;
+	}
+	port->RxLastActivity = now;
+	port->RxStreak += bytes;
+	if( port->RxStreak >= rx_poll_enter )
+	{
+		rpc_max3140_rx_poll_enter( port );
+	}
+}
+
+/* Response of a RdDat queued as part of a burst. The burst ends with the
+ * first read which did not receive a byte, the remaining reads are dropped.
+ * The size of the next burst follows the number of bytes received.
+ */
+static void irq_msg_burst_read_done( RaspiCommPort_t* port,
+				uint16_t send_data, uint16_t recv_data )
+{
+	unsigned long spinlock_flags;
+	bool received;
+	bool ended = false;
+	bool again = false;
+	unsigned int bytes = 0;
+
+	LOG( "irq_msg_burst_read_done" );
+	received = recv_data & MAX3140_RECEIVE_BUFFER_FULL;
+	rpc_max3140_read_response( port, recv_data );
+
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	if( port->RxBurstLeft > 0 )
+	{
+		port->RxBurstLeft--;
+		port->RxBurstReads++;
+		if( received )
+		{
+			port->RxBurstReceived++;
+			port->RxBurstBytes++;
+		}
+		if( !received || port->RxBurstLeft == 0 )
+		{
+			// end of the burst, drop the reads still queued
+			if( port->RxBurstLeft > 0 )
+			{
+				port->RxBurstCancelled = port->RxBurstId;
+				port->RxBurstLeft = 0;
+			}
+			port->RxBurstSize = port->RxBurstReceived + 1;
+			bytes = port->RxBurstReceived;
+			again = port->RxBurstRearm;
+			port->RxBurstRearm = false;
+			ended = true;
+		}
+	}
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	if( !ended )
+	{
+		return;
+	}
+	rpc_max3140_rx_mode_update( port, bytes );
+	if( READ_ONCE(port->RxPolling) && received )
+	{
+		// the irq pin does not show received data in polled mode,
+		// the FIFO may still contain data if the whole burst got some
+		again = true;
+	}
+	if( again || !gpio_get_value( port->irqGPIO ) )
+	{
+		// irq pin is still low or went low during the burst, read again
+		rpc_max3140_read_data( port );
+	}
+	else
+	{
+		// end of the data burst, pass it to the tty
+		rpc_rx_flush( port );
+	}
+}
+
+/* Receive mode is on the bus, account the turnaround time of the frame.
+ */
+static void stop_transmitting_done( RaspiCommPort_t* port,
+				uint16_t send_data, uint16_t recv_data )
+{
+	unsigned long spinlock_flags;
+	ktime_t now;
+	u64 ns;
+
+	LOG( "stop_transmitting_done" );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	if( port->TxFrameEnd )
+	{
+		now = ktime_get();
+		rpc_lat_tx_done( port, port->TxFrameEnd, now );
+		ns = max_t( s64, ktime_to_ns( ktime_sub( now,
+						port->TxFrameEnd ) ), 0 );
+		port->TxFrameEnd = 0;
+		port->Rs485Frames++;
+		port->Rs485TurnLastNs = ns;
+		trace_rpc_rs485_turnaround( port->index, ns );
+		port->Rs485TurnTotalNs += ns;
+		if( ns > port->Rs485TurnMaxNs )
+		{
+			port->Rs485TurnMaxNs = ns;
+		}
+	}
+	if( port->TxActive && !port->Rs485DriverOn )
+	{
+		// no new transmission has started, this is the end
+		port->TxActive = 0;
+		complete_all( &port->tx_done );
+		// tty_wait_until_sent() waits for chars_in_buffer() to drop to 0
+		schedule_work( &port->tx_wakeup_work );
+	}
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+}
+
+/* The last byte and delay_rts_after_send are over, switch the RS485 driver
+ * off unless a new transmission has started meanwhile.
+ */
+static enum hrtimer_restart last_byte_sent( struct hrtimer *timer )
+{
+	RaspiCommPort_t* port =
+			container_of( timer, RaspiCommPort_t, last_byte_sent_timer );
+	unsigned long spinlock_flags;
+
+	LOG( "last_byte_sent" );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	if( !(port->UartConfig & MAX3140_CFG_ENABLE_TX_INT) )
+	{
+		port->Rs485DriverOn = 0;
+		rpc_spi_transfer_deferrable( port, RPC_DEFER_RECEIVE_MODE );
+	}
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	return HRTIMER_NORESTART;
+}
+
+/* delay_rts_before_send is over, send the first byte.
+ */
+static enum hrtimer_restart tx_start_delay_done( struct hrtimer *timer )
+{
+	RaspiCommPort_t* port = container_of( timer, RaspiCommPort_t, tx_start_timer );
+	unsigned long spinlock_flags;
+
+	LOG( "tx_start_delay_done" );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	port->TxHold = 0;
+	if( port->TxPaused )
+	{
+		// stopped meanwhile, the read ends the frame
+		rpc_spi_transfer_deferrable( port, RPC_DEFER_TX_KICK );
+	}
+	else if( (port->UartConfig & MAX3140_CFG_ENABLE_TX_INT) &&
+			!port->TxWordQueued )
+	{
+		rpc_max3140_tx_send_next( port );
+	}
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	return HRTIMER_NORESTART;
+}
+
+#if 0
+static void configure_uart_done( RaspiCommPort_t* port,
+				uint16_t send_data, uint16_t recv_data )
+{
+	LOG( "configure_uart_done" );
+	// nothing to do here
+}
+#else
+#define configure_uart_done 0
+#endif
 
 
 // }}} spi functions
 //============================================================================
 // {{{ raspicomm private function
 
-static void rpc_tty_cleanup( struct platform_device* pdev )
+/* Stop a port, works on a partially initialized one as well. The SPI
+ * transfers may still run, they are cancelled for all ports together.
+ */
+static void rpc_port_stop( RaspiCommPort_t* port )
 {
 	unsigned long spinlock_flags;
-	LOG_DBG( "cleanup all" );
+	LOG_DBG( "stopping ttyRPC%u", port->index );
 
-	spin_lock_irqsave( &rcd.dev_lock, spinlock_flags );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
 	// set the shutdown flag
-	rcd.UartConfig |= MAX3140_BLOCK_COMMUNICATION;
+	port->UartConfig |= MAX3140_BLOCK_COMMUNICATION;
 	// clear the queue
-	rcd.TxQueue.read = rcd.TxQueue.write;
-	spin_unlock_irqrestore( &rcd.dev_lock, spinlock_flags );
+	if( port->TxQueue.arr )
+	{
+		queue_clear( &port->TxQueue );
+	}
+	// release tcdrain()
+	port->TxActive = 0;
+	complete_all( &port->tx_done );
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	tty_port_tty_wakeup( &port->tty_port );
+	// a port still open must not keep the CPUs awake
+	rpc_port_qos_remove( port );
 
 	// remove the interrupt
-	if( rcd.irqNumber >= 0 )
+	if( port->irqNumber >= 0 )
 	{
 		LOG_DBG( "free_irq" );
-		free_irq( rcd.irqNumber, NULL );
+		irq_set_affinity_hint( port->irqNumber, NULL );
+		free_irq( port->irqNumber, port );
+		port->irqNumber = -EINVAL;
 	}
 	// cancel the timer
-	if( rcd.last_byte_sent_timer_initialized )
+	if( port->last_byte_sent_timer_initialized )
 	{
 		LOG_DBG( "hrtimer_cancel" );
-		hrtimer_cancel( &rcd.last_byte_sent_timer );
+		port->RxPolling = 0;
+		hrtimer_cancel( &port->rx_poll_timer );
+		hrtimer_cancel( &port->rx_flush_timer );
+		hrtimer_cancel( &port->tx_start_timer );
+		hrtimer_cancel( &port->last_byte_sent_timer );
+	}
+}
+
+static void rpc_tty_cleanup( struct platform_device* pdev )
+{
+	RaspiCommPort_t* port;
+	unsigned int i;
+	LOG_DBG( "cleanup all" );
+
+	for( i = 0; i < rcd.port_count; i++ )
+	{
+		rpc_port_stop( rcd.ports[i] );
 	}
 
 	// wait for all SPI transfers to finish
@@ -618,168 +1927,320 @@ static void rpc_tty_cleanup( struct platform_device* pdev )
 	// do all the remaining cleanup...
 	if( rcd.tty_drv )
 	{
+		for( i = 0; i < rcd.port_count; i++ )
+		{
+			if( rcd.ports[i]->tty_registered )
+			{
+				LOG_DBG( "tty_unregister_device" );
+				tty_unregister_device( rcd.tty_drv, i );
+			}
+		}
 		LOG_DBG( "tty_unregister_driver" );
 		tty_unregister_driver( rcd.tty_drv );
 		LOG_DBG( "put_tty_driver" );
 		put_tty_driver( rcd.tty_drv );
+		rcd.tty_drv = NULL;
 	}
-	if( rcd.irqGPIO >= 0 )
+	for( i = 0; i < rcd.port_count; i++ )
 	{
-		LOG_DBG( "gpio_free" );
-		gpio_free( rcd.irqGPIO );
+		port = rcd.ports[i];
+		if( port->irqGPIO >= 0 )
+		{
+			LOG_DBG( "gpio_free" );
+			gpio_free( port->irqGPIO );
+		}
+		// the transfers are done, no wakeup is scheduled any more
+		cancel_work_sync( &port->tx_wakeup_work );
+		tty_port_destroy( &port->tty_port );
+		queue_free( &port->TxQueue );
+		queue_free( &port->RxHold );
 	}
+	rcd.port_count = 0;
 	LOG_DBG( "cleanup done" );
 }
 
-// initialization function that gets called when the module is loaded
-static int rpc_tty_init( struct platform_device* pdev )
+/* Read the ports from the device tree. They are child nodes of the SPI node
+ * compatible to "raspicomm,max3140", "reg" is the chip select and
+ * "irq-gpios" the INT pin of the MAX3140. Without such nodes there is one
+ * port on CE0 with its INT on GPIO17 as on the RaspiComm board.
+ * The bus is shared, the lowest "spi-max-frequency" of the ports limits
+ * the SPI clock of all of them, max_hz is left alone if there is none.
+ * Returns the number of ports.
+ */
+static unsigned int rpc_ports_from_dt( struct platform_device* pdev,
+				unsigned int* cs, int* pins, unsigned int* max_hz )
 {
-	unsigned long spinlock_flags;
-	int pin = 17;
-	int result;
-
-	// log the start of the initialization
-	LOG_INFO( "raspicommrs485 init: version " RASPICOMM_VERSION );
-
-	LOG_DBG( "initializing globals" );
-	// raspicommDriver = NULL;
-	// memset( &Port, 0, sizeof(Port) );
-	// OpenCount = 0;
-	// ParityIsOdd = 0;
-	// ParityEnabled = 0;
-	// OpenTTY = NULL;
-	// memset( &TxQueue, 0, sizeof(TxQueue) );
-	rcd.UartConfig = MAX3140_BLOCK_COMMUNICATION;
-	// spi_slave = NULL;
-	rcd.irqGPIO = -EINVAL;
-	rcd.irqNumber = -EINVAL;
-	// last_byte_sent_timer_initialized = 0;
+	struct device_node* child;
+	unsigned int n = 0;
+	unsigned int i;
+	u32 reg;
+	u32 hz;
+	int pin;
+
+	for_each_available_child_of_node( pdev->dev.of_node, child )
+	{
+		if( !of_device_is_compatible( child, "raspicomm,max3140" ) )
+		{
+			continue;
+		}
+		if( n == RPC_MAX_PORTS )
+		{
+			LOG_ERR( "more than %d ports, ignoring %pOF", RPC_MAX_PORTS, child );
+			of_node_put( child );
+			break;
+		}
+		if( of_property_read_u32( child, "reg", &reg ) || reg >= RPC_MAX_PORTS )
+		{
+			LOG_ERR( "%pOF: missing or invalid chip select", child );
+			continue;
+		}
+		pin = of_get_named_gpio( child, "irq-gpios", 0 );
+		if( pin < 0 )
+		{
+			LOG_ERR( "%pOF: missing irq-gpios (%d)", child, pin );
+			continue;
+		}
+		for( i = 0; i < n && cs[i] != reg; i++ )
+		{
+		}
+		if( i < n )
+		{
+			LOG_ERR( "%pOF: chip select %u is used twice", child, reg );
+			continue;
+		}
+		if( !of_property_read_u32( child, "spi-max-frequency", &hz ) && hz )
+		{
+			*max_hz = min( *max_hz, hz );
+		}
+		cs[n] = reg;
+		pins[n] = pin;
+		n++;
+	}
+	if( n == 0 )
+	{
+		cs[0] = 0;
+		pins[0] = 17;
+		n = 1;
+	}
+	return n;
+}
 
-#if 0
-	/*
-	static int of_spi_register_master(struct spi_master *master)
-	int nb, i, *cs;
-	struct device_node *np = master->dev.of_node;
-	*/
+/* Set up the MAX3140 of a port and its interrupt, the tty device is
+ * registered later.
+ */
+static int rpc_port_init( RaspiCommPort_t* port, int pin )
+{
+	int result;
 
-	if( of_gpio_named_count( np, "cs-gpios" ) < 1 )
+	result = queue_init( &port->TxQueue, tx_queue_size );
+	if( result < 0 )
 	{
-		LOG_ERR( "of_gpio_named_count(cs-gpios) failed" );
-		return -ENOENT;
+		LOG_ERR( "queue_init failed with code %d", result );
+		return result;
 	}
-	cs[i] = of_get_named_gpio( np, "cs-gpios", 1 );
-#endif
+	result = queue_init( &port->RxHold, RX_HOLD_SIZE );
+	if( result < 0 )
+	{
+		LOG_ERR( "queue_init failed with code %d", result );
+		return result;
+	}
+	port->TxWriteCmds = rpc_max3140_write_cmds[PARITY_OFF];
+	// the board is always RS485, the driver is enabled while sending
+	port->Rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+
+	LOG_DBG( "initializing hrtimer" );
+	hrtimer_init( &port->last_byte_sent_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL );
+	port->last_byte_sent_timer.function = &last_byte_sent;
+	hrtimer_init( &port->rx_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL );
+	port->rx_poll_timer.function = &rx_poll_timer_expired;
+	hrtimer_init( &port->rx_flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL );
+	port->rx_flush_timer.function = &rx_flush_timer_expired;
+	hrtimer_init( &port->tx_start_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL );
+	port->tx_start_timer.function = &tx_start_delay_done;
+	port->last_byte_sent_timer_initialized = 1;
+	port->IrqThreadCpu = -1;
+
 	// Request a GPIO pin from the driver
-	LOG_DBG( "gpio_request" );
-	result = gpio_request( pin, "rpc0irq" );
+	LOG_DBG( "gpio_request( %d )", pin );
+	snprintf( port->irq_name, sizeof(port->irq_name), "rpc%uirq", port->index );
+	result = gpio_request( pin, port->irq_name );
 	if( result < 0 )
 	{
 		LOG_ERR( "gpio_request failed with code %d", result );
-		goto cleanup;
+		return result;
 	}
-	rcd.irqGPIO = pin;
-	// 'irqGPIO' is expected to be an unsigned int, i.e. the GPIO number
+	port->irqGPIO = pin;
 	// Set GPIO as input
 	LOG_DBG( "gpio_direction_input" );
-	result = gpio_direction_input( rcd.irqGPIO );
+	result = gpio_direction_input( port->irqGPIO );
 	if( result < 0 )
 	{
 		LOG_ERR( "gpio_direction_input failed with code %d", result );
-		goto cleanup;
+		return result;
 	}
 
 	// map your GPIO to an IRQ
-	LOG_DBG( "gpio_to_irq( %d )", rcd.irqGPIO );
-	rcd.irqNumber = gpio_to_irq( rcd.irqGPIO );
-	if( rcd.irqNumber < 0 )
+	LOG_DBG( "gpio_to_irq( %d )", port->irqGPIO );
+	result = gpio_to_irq( port->irqGPIO );
+	if( result < 0 )
 	{
 		LOG_ERR( "gpio_to_irq failed with code %d", result );
-		goto cleanup;
+		return result;
 	}
 	// requested interrupt
-	LOG_DBG( "request_irq = %d", rcd.irqNumber );
-	result = request_irq( rcd.irqNumber, raspicomm_irq_handler,
+	LOG_DBG( "request_irq = %d", result );
+	port->irqNumber = result;
+	if( rcd.threaded )
+	{
+		// the hard handler only takes the time, the reads are queued by
+		// the thread
+		result = request_threaded_irq( port->irqNumber, raspicomm_irq_hard,
+						raspicomm_irq_thread,
+						IRQF_TRIGGER_FALLING | IRQF_NO_THREAD,
+						IRQ_DEV_NAME, port );
+	}
+	else
+	{
+		result = request_irq( port->irqNumber, raspicomm_irq_handler,
 						// interrupt mode flag
 						IRQF_TRIGGER_FALLING,
 						// used in /proc/interrupts
 						IRQ_DEV_NAME,
-						// the *dev_id shared interrupt lines, NULL is okay
-						NULL );
+						// the handler gets the port
+						port );
+	}
 	if( result < 0 )
 	{
 		LOG_ERR( "request_irq failed with code %d", result );
-		goto cleanup;
+		port->irqNumber = -EINVAL;
+		return result;
 	}
 
 	// initialize the port
-	LOG_DBG( "tty_port_init" );
-	tty_port_init( &rcd.tty_port );
-	rcd.tty_port.low_latency = 1;
+	port->tty_port.low_latency = 1;
+	return 0;
+}
+
+// initialization function that gets called when the module is loaded
+static int rpc_tty_init( struct platform_device* pdev )
+{
+	unsigned long spinlock_flags;
+	unsigned int cs[RPC_MAX_PORTS];
+	int pins[RPC_MAX_PORTS];
+	unsigned int count;
+	unsigned int max_hz = MAX3140_SCLK_MAX_HZ;
+	struct tty_driver* drv;
+	struct device* tty_dev;
+	RaspiCommPort_t* port;
+	unsigned int i;
+
+	// log the start of the initialization
+	LOG_INFO( "raspicommrs485 init: version " RASPICOMM_VERSION );
+
+	LOG_DBG( "initializing ports" );
+	rpc_max3140_init_write_cmds();
+	count = rpc_ports_from_dt( pdev, cs, pins, &max_hz );
+	rcd.spi_max_hz = max_hz;
+	if( rcd.spi_nominal_hz > max_hz )
+	{
+		LOG_INFO( "spi clock limited to %u Hz by the device tree", max_hz );
+		rpc_spi_set_speed( max_hz );
+	}
+	for( i = 0; i < count; i++ )
+	{
+		port = devm_kzalloc( &pdev->dev, sizeof(*port), GFP_KERNEL );
+		if( !port )
+		{
+			goto cleanup;
+		}
+		port->index = i;
+		port->cs = cs[i];
+		spin_lock_init( &port->dev_lock );
+		raw_spin_lock_init( &port->lat_lock );
+		mutex_init( &port->QosLock );
+		port->UartConfig = MAX3140_BLOCK_COMMUNICATION;
+		port->irqGPIO = -EINVAL;
+		port->irqNumber = -EINVAL;
+		init_completion( &port->tx_done );
+		INIT_WORK( &port->tx_wakeup_work, rpc_tx_wakeup_work );
+		tty_port_init( &port->tty_port );
+		rcd.ports[i] = port;
+		rcd.port_count++;
+		if( rpc_port_init( port, pins[i] ) )
+		{
+			goto cleanup;
+		}
+		LOG_INFO( "ttyRPC%u: chip select %u, interrupt on GPIO %d",
+				i, port->cs, port->irqGPIO );
+	}
 
 	// allocate the driver
 	LOG_DBG( "tty_alloc_driver" );
-	rcd.tty_drv = tty_alloc_driver( PORT_COUNT, TTY_DRIVER_REAL_RAW );
+	drv = tty_alloc_driver( rcd.port_count,
+			TTY_DRIVER_REAL_RAW | TTY_DRIVER_DYNAMIC_DEV );
 
 	// return if allocation fails
-	if( IS_ERR( rcd.tty_drv ) )
+	if( IS_ERR( drv ) )
 	{
 		LOG_ERR( "tty_alloc_driver failed" );
 		goto cleanup;
 	}
 
 	// init the driver
-	rcd.tty_drv->owner					= THIS_MODULE;
-	rcd.tty_drv->driver_name			= "raspicomm rs485";
-	rcd.tty_drv->name					= "ttyRPC";
-	rcd.tty_drv->major					= RaspicommMajorDriverNumber;
-	rcd.tty_drv->minor_start			= 0;
-	//rcd.tty_drv->flags				= TTY_DRIVER_REAL_RAW;
-	rcd.tty_drv->type					= TTY_DRIVER_TYPE_SERIAL;
-	rcd.tty_drv->subtype				= SERIAL_TYPE_NORMAL;
-	rcd.tty_drv->init_termios			= tty_std_termios;
-	rcd.tty_drv->init_termios.c_ispeed  = 9600;
-	rcd.tty_drv->init_termios.c_ospeed  = 9600;
-	rcd.tty_drv->init_termios.c_iflag   = 0;
-	rcd.tty_drv->init_termios.c_oflag   = 0;
-	rcd.tty_drv->init_termios.c_cflag   = B9600 | CREAD | CS8 | CLOCAL;
-	rcd.tty_drv->init_termios.c_lflag   = 0;
-
-	// ++++ is that OK?
-	// rcd.tty_drv->driver_state = rcd;
-	// +++->tty_struct->driver_data = rcd;
-	// +++->tty_struct->disc_data = rcd;
-	//rcd.tty_open->driver_data = rcd;
+	drv->owner					= THIS_MODULE;
+	drv->driver_name			= "raspicomm rs485";
+	drv->name					= "ttyRPC";
+	drv->major					= RaspicommMajorDriverNumber;
+	drv->minor_start			= 0;
+	drv->type					= TTY_DRIVER_TYPE_SERIAL;
+	drv->subtype				= SERIAL_TYPE_NORMAL;
+	drv->init_termios			= tty_std_termios;
+	drv->init_termios.c_ispeed	= 9600;
+	drv->init_termios.c_ospeed	= 9600;
+	drv->init_termios.c_iflag	= 0;
+	drv->init_termios.c_oflag	= 0;
+	drv->init_termios.c_cflag	= B9600 | CREAD | CS8 | CLOCAL;
+	drv->init_termios.c_lflag	= 0;
 
 	// initialize function callbacks of tty_driver,
 	// necessary before tty_register_driver()
 	LOG_DBG( "tty_set_operations" );
-	tty_set_operations( rcd.tty_drv, &raspicomm_ops );
-
-	// link the port with the driver
-	LOG_DBG( "tty_port_link_device" );
-	tty_port_link_device( &rcd.tty_port, rcd.tty_drv, 0 );
+	tty_set_operations( drv, &raspicomm_ops );
 
 	// try to register the tty driver
 	LOG_DBG( "tty_register_driver" );
-	if( tty_register_driver( rcd.tty_drv ) )
+	if( tty_register_driver( drv ) )
 	{
 		LOG_ERR( "tty_register_driver failed" );
+		put_tty_driver( drv );
 		goto cleanup;
 	}
+	rcd.tty_drv = drv;
 
-	LOG_DBG( "initializing hrtimer" );
-	hrtimer_init( &rcd.last_byte_sent_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL );
-	rcd.last_byte_sent_timer.function = &last_byte_sent;
-	rcd.last_byte_sent_timer_initialized = 1;
-
-	// now configure the UART
-	rpc_spi_transfer_word( MAX3140_CMD_RECEIVE_MODE, stop_transmitting_done );
-	rpc_max3140_configure( 9600, DATABITS_8, STOPBITS_ONE, PARITY_OFF );
-
-	// successfully initialized the module
-	spin_lock_irqsave( &rcd.dev_lock, spinlock_flags );
-	rcd.UartConfig &= ~MAX3140_BLOCK_COMMUNICATION;
-	spin_unlock_irqrestore( &rcd.dev_lock, spinlock_flags );
+	for( i = 0; i < rcd.port_count; i++ )
+	{
+		port = rcd.ports[i];
+		// links the port with the driver, the per port statistics are
+		// attributes of the tty device
+		LOG_DBG( "tty_port_register_device_attr" );
+		tty_dev = tty_port_register_device_attr( &port->tty_port, drv, i,
+				&pdev->dev, port, rpc_port_groups );
+		if( IS_ERR( tty_dev ) )
+		{
+			LOG_ERR( "registering ttyRPC%u failed", i );
+			goto cleanup;
+		}
+		port->tty_registered = 1;
+
+		// now configure the UART
+		rpc_spi_transfer_deferrable( port, RPC_DEFER_RECEIVE_MODE );
+		rpc_max3140_configure( port, 9600, DATABITS_8, STOPBITS_ONE, PARITY_OFF );
+
+		// successfully initialized the port
+		spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+		port->UartConfig &= ~MAX3140_BLOCK_COMMUNICATION;
+		spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	}
 	LOG_INFO( "raspicomm_init() completed" );
 	return 0;
 
@@ -817,32 +2278,39 @@ static unsigned char rpc_max3140_get_baudrate_index( speed_t speed )
 	}
 }
 
-static void rpc_max3140_configure( speed_t speed,
+static void rpc_max3140_configure( RaspiCommPort_t* port, speed_t speed,
 				Databits databits, Stopbits stopbits, Parity parity )
 {
 	unsigned long spinlock_flags;
 	ktime_t delay;
+	const uint16_t* cmds = rpc_max3140_write_cmds[parity];
 	int config = MAX3140_CMD_WRITE_CONFIG | MAX3140_CFG_ENABLE_RX_INT;
 	// default is 8 data bits plus startbit plus stop bit
-	int bit_count = 8+2;
+	int bit_count = 1+8+1;
 
 	config |= rpc_max3140_get_baudrate_index( speed );
+	if( (config & MAX3140_CFG_BAUDRATE_MASK) == MAX3140_BAUDRATE_9600 )
+	{
+		// unsupported speeds fall back to 9600
+		speed = 9600;
+	}
 	if( databits == DATABITS_7 )
 	{
 		config |= MAX3140_CFG_7_BIT_WORDS;
-		databits--;
+		bit_count--;
 	}
 	if( stopbits == STOPBITS_TWO )
 	{
 		config |= MAX3140_CFG_TWO_STOP_BITS;
-		databits++;
+		bit_count++;
 	}
 	if( parity != PARITY_OFF )
 	{
 		config |= MAX3140_CFG_ENABLE_PARITY;
-		databits++;
+		bit_count++;
 	}
-	delay = ktime_set( 0, (NSEC_PER_SEC / speed) * bit_count );
+	// round up, the receive mode must never come too early
+	delay = ktime_set( 0, DIV_ROUND_UP( (u64)NSEC_PER_SEC * bit_count, speed ) );
 
 	LOG( "rpc_max3140_configure() called "
 		"speed=%i, databits=%i, stopbits=%i, parity=%i "
@@ -850,154 +2318,518 @@ static void rpc_max3140_configure( speed_t speed,
 		speed, databits, stopbits, parity,
 		config, (int)ktime_to_us(delay) );
 
-	spin_lock_irqsave( &rcd.dev_lock, spinlock_flags );
-	config |= rcd.UartConfig &
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	config |= port->UartConfig &
 				(MAX3140_BLOCK_COMMUNICATION | MAX3140_CFG_ENABLE_TX_INT);
-	if( rcd.UartConfig != config )
+	if( port->RxPolling )
+	{
+		// the RX interrupt stays off in polled mode
+		config &= ~MAX3140_CFG_ENABLE_RX_INT;
+	}
+	if( port->UartConfig != config )
 	{
 		// update the uart only if the config changed
-		rcd.UartConfig = config;
-		rcd.OneCharDelay = delay;
-		rcd.ParityEnabled = parity != PARITY_OFF;
-		rcd.ParityIsOdd = parity == PARITY_ODD;
-		rpc_spi_transfer_word( rcd.UartConfig, configure_uart_done );
+		port->UartConfig = config;
+		port->OneCharDelay = delay;
+		rpc_spi_transfer_deferrable( port, RPC_DEFER_WRITE_CONFIG );
+	}
+	if( port->TxWriteCmds != cmds )
+	{
+		// odd and even parity share the config, check them separately
+		// the queued bytes are encoded again for the new parity, the
+		// tty layer keeps write() out during set_termios()
+		WRITE_ONCE( port->TxWriteCmds, cmds );
+		queue_remap( &port->TxQueue, cmds );
+	}
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+}
+
+/* Build the WrDat commands for all bytes and parity modes, the parity bit
+ * is set for an odd number of one bits with even parity and inverted with
+ * odd parity.
+ */
+static void rpc_max3140_init_write_cmds(void)
+{
+	int data;
+	int n;
+
+	for( data = 0; data < QUEUE_MAP_SIZE; data++ )
+	{
+		n = hweight8( data ) & 1;
+		rpc_max3140_write_cmds[PARITY_OFF][data] =
+				MAX3140_CMD_WRITE_DATA | data;
+		rpc_max3140_write_cmds[PARITY_EVEN][data] =
+				MAX3140_CMD_WRITE_DATA | data |
+				(n << MAX3140_PARITY_BIT_INDEX);
+		rpc_max3140_write_cmds[PARITY_ODD][data] =
+				MAX3140_CMD_WRITE_DATA | data |
+				((n ^ 1) << MAX3140_PARITY_BIT_INDEX);
 	}
-	spin_unlock_irqrestore( &rcd.dev_lock, spinlock_flags );
 }
 
-static int rpc_max3140_make_write_data_cmd( int data )
+/* Count an interrupt of the MAX3140, only called by its handler which does
+ * not run concurrently with itself.
+ */
+static inline void rpc_gpio_irq_count( RaspiCommPort_t* port )
 {
-	data |= MAX3140_CMD_WRITE_DATA;
-	if( rcd.ParityEnabled )
+	port->GpioIrqs++;
+	if( raw_smp_processor_id() != READ_ONCE( rcd.complete_cpu ) )
 	{
-		int n = data;
-		// put the xor of the lowest 8 bits into bit 0 of n
-		n ^= (n >> 4);
-		n ^= (n >> 2);
-		n ^= (n >> 1);
-		n &= 1;
-		// now 0 = even number of one bits, 1 = odd, this is even parity
-		// add parity config, for odd parity the bit must be inverted
-		n ^= rcd.ParityIsOdd;
-		// add the parity bit to the command
-		data |= n << MAX3140_PARITY_BIT_INDEX;
+		port->GpioCrossCpu++;
 	}
-	return data;
 }
 
 static irqreturn_t raspicomm_irq_handler( int irq, void* dev_id )
 {
+	RaspiCommPort_t* port = dev_id;
+
 	LOG( "raspicomm_irq_handler" );
-	rpc_spi_transfer_word( MAX3140_CMD_READ_DATA, irq_msg_read_done );
+	rpc_lat_rx_irq( port );
+	rpc_gpio_irq_count( port );
+	rpc_max3140_read_data( port );
 	return IRQ_HANDLED;
 }
 
-// this function pushes a received character to the opened tty device,
-// called by the interrupt function
-static void raspicomm_rs485_received( struct tty_struct* tty, int c )
+/* Apply irq_thread_prio to the calling interrupt thread if it has changed,
+ * *applied is the clamped value last applied. From 5.9 on modules can only choose
+ * between the SCHED_FIFO priorities of sched_set_fifo() (50) and
+ * sched_set_fifo_low() (1), values from 50 up get the former, lower ones
+ * the latter. A value which can not be used as it is gets logged.
+ */
+static void rpc_irq_thread_prio( int* applied )
 {
-	LOG( "raspicomm_rs485_received(c=%03X)", c & 0x1FF );
-
-	// ++++ (mf) should check parity here!?!
+	int requested = READ_ONCE( irq_thread_prio );
+	int prio = clamp_t( int, requested, 1, MAX_RT_PRIO - 1 );
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
+	struct sched_param param;
+#endif
 
-	if( tty != NULL && tty->port != NULL )
+	if( prio == *applied )
 	{
-		// send the character to the tty
-		tty_insert_flip_char( tty->port, c, TTY_NORMAL );
-
-		// tell it to flip the buffer
-		tty_flip_buffer_push( tty->port );
+		return;
+	}
+	*applied = prio;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
+	param.sched_priority = prio;
+	if( sched_setscheduler_nocheck( current, SCHED_FIFO, &param ) )
+	{
+		LOG_ERR( "could not set the priority of the interrupt thread" );
+		return;
+	}
+#else
+	if( prio >= MAX_RT_PRIO / 2 )
+	{
+		sched_set_fifo( current );
+		prio = MAX_RT_PRIO / 2;
+	}
+	else
+	{
+		sched_set_fifo_low( current );
+		prio = 1;
+	}
+#endif
+	if( prio != requested )
+	{
+		LOG_ERR( "irq_thread_prio %d is not supported, the interrupt thread "
+				"runs at SCHED_FIFO priority %d", requested, prio );
 	}
 }
 
-// }}} raspicomm private function
-//============================================================================
-// {{{ TTY Interface Functions
-
-// called by the kernel when open() is called for the device
-static int rpc_tty_open( struct tty_struct* tty, struct file* file )
+/* In exclusive mode pin the calling interrupt thread to irq_cpu, else let
+ * it run where the kernel puts it. *applied is the CPU the thread is
+ * pinned to, -1 if none.
+ */
+static void rpc_irq_thread_cpu( int* applied )
 {
-	LOG_DBG( "rpc_tty_open() called" );
+	int cpu = READ_ONCE( irq_cpu_exclusive ) ? READ_ONCE( rcd.irq_cpu ) : -1;
 
-	if( rcd.tty_opened )
+	if( cpu != *applied )
 	{
-		LOG_ERR( "rpc_tty_open() was not successful as rcd.tty_opened != 0" );
-		return -ENODEV;
+		*applied = cpu;
+		if( set_cpus_allowed_ptr( current,
+					cpu >= 0 ? cpumask_of( cpu ) : cpu_online_mask ) )
+		{
+			LOG_ERR( "could not pin the interrupt thread to cpu %d", cpu );
+		}
 	}
-	else
-	{
-		LOG_INFO( "rpc_tty_open() was successful" );
+}
 
-		rcd.tty_open = tty;
-		rcd.tty_opened = 1;
+/* Pin an interrupt to a CPU, -1 gives it back to the kernel.
+ * Returns 0 or the error of the interrupt controller.
+ */
+static int rpc_irq_pin( unsigned int irq, int cpu )
+{
+	int err;
 
-		return SUCCESS;
+	if( cpu < 0 )
+	{
+		// the hint must be gone before the interrupt is freed
+		err = irq_set_affinity_hint( irq, cpu_online_mask );
+		irq_set_affinity_hint( irq, NULL );
+		return err;
 	}
+	return irq_set_affinity_hint( irq, cpumask_of( cpu ) );
 }
 
-// called by the kernel when close() is called for the device
-static void rpc_tty_close( struct tty_struct* tty, struct file* file )
+/* Pin the SPI interrupt, the interrupts of the ports and the timers to a
+ * CPU, -1 gives them back to the kernel. The interrupt threads follow with
+ * their next interrupt.
+ */
+static int rpc_irq_set_cpu( int cpu )
 {
-	LOG_DBG( "rpc_tty_close called" );
-	if( !rcd.tty_opened )
+	unsigned int i;
+
+	if( cpu >= (int)nr_cpu_ids || (cpu >= 0 && !cpu_online( cpu )) )
 	{
-		LOG_ERR( "rpc_tty_close: can't close device since it is already closed" );
+		return -EINVAL;
 	}
-	else
+	WRITE_ONCE( rcd.irq_cpu, cpu < 0 ? -1 : cpu );
+	rcd.spi_irq_pin_err = rpc_irq_pin( rcd.spi_irq, rcd.irq_cpu );
+	if( rcd.spi_irq_pin_err )
 	{
-		// rcd.tty_open->driver_data = NULL;
-		rcd.tty_open = NULL;
-		rcd.tty_opened = 0;
-		LOG_INFO( "rpc_tty_close: device was closed" );
+		LOG_ERR( "could not pin the spi interrupt to cpu %d: %d",
+				rcd.irq_cpu, rcd.spi_irq_pin_err );
 	}
-}
+	for( i = 0; i < rcd.port_count; i++ )
+	{
+		RaspiCommPort_t* port = rcd.ports[i];
 
-static int rpc_tty_write( struct tty_struct* tty,
-	const unsigned char* buf, int count )
-{
-	unsigned long spinlock_flags;
+		if( port->irqNumber >= 0 )
+		{
+			port->IrqPinErr = rpc_irq_pin( port->irqNumber, rcd.irq_cpu );
+			if( port->IrqPinErr )
+			{
+				LOG_ERR( "could not pin the interrupt of ttyRPC%u to cpu %d: %d",
+						port->index, rcd.irq_cpu, port->IrqPinErr );
+			}
+		}
+	}
+	return 0;
+}
+
+/* Hard part of the MAX3140 interrupt in threaded mode.
+ */
+static irqreturn_t raspicomm_irq_hard( int irq, void* dev_id )
+{
+	RaspiCommPort_t* port = dev_id;
+
+	rpc_lat_rx_irq( port );
+	rpc_gpio_irq_count( port );
+	return IRQ_WAKE_THREAD;
+}
+
+/* Threaded part of the MAX3140 interrupt, reads the received bytes.
+ */
+static irqreturn_t raspicomm_irq_thread( int irq, void* dev_id )
+{
+	RaspiCommPort_t* port = dev_id;
+
+	LOG( "raspicomm_irq_thread" );
+	rpc_irq_thread_prio( &port->IrqThreadPrio );
+	rpc_irq_thread_cpu( &port->IrqThreadCpu );
+	rpc_max3140_read_data( port );
+	return IRQ_HANDLED;
+}
+
+/* Pass the collected bytes to the tty, dev_lock must be held.
+ */
+static void rpc_rx_flush_locked( RaspiCommPort_t* port )
+{
+	struct tty_struct* tty = port->tty_open;
+
+	unsigned int i;
+	int pushed;
+
+	if( port->RxBatchCount == 0 )
+	{
+		return;
+	}
+	if( port->RxThrottled )
+	{
+		// keep the bytes until the tty has room again
+		for( i = 0; i < port->RxBatchCount; i++ )
+		{
+			if( !queue_enqueue( &port->RxHold, port->RxBatch[i] |
+						(uint8_t)port->RxBatchFlags[i] << 8 ) )
+			{
+				port->RxOverruns++;
+				port->RxHoldOverrun = 1;
+			}
+		}
+		if( queue_get_room( &port->RxHold ) < RX_HOLD_SIZE / 4 )
+		{
+			// let the MAX3140 FIFO hold the following bytes
+			port->RxStalled = 1;
+		}
+	}
+	else if( tty != NULL && tty->port != NULL )
+	{
+		pushed = tty_insert_flip_string_flags( tty->port, port->RxBatch,
+				port->RxBatchFlags, port->RxBatchCount );
+		// bytes the flip buffer had no room for are lost
+		port->RxOverruns += port->RxBatchCount - pushed;
+		trace_rpc_rx_push( port->index, port->RxBatchCount, pushed );
+		// tell it to flip the buffer
+		tty_flip_buffer_push( tty->port );
+		rpc_lat_rx_pushed( port );
+		port->RxPushes++;
+		port->RxPushedBytes += port->RxBatchCount;
+	}
+	port->RxBatchCount = 0;
+	// the flush timer may be running this, so do not wait for it
+	hrtimer_try_to_cancel( &port->rx_flush_timer );
+}
+
+/* Read received data unless the RX path is stalled by a throttled tty. The
+ * reads go on while transmitting, they drive the TX chain.
+ */
+static void rpc_max3140_read_data( RaspiCommPort_t* port )
+{
+	unsigned long spinlock_flags;
+	bool read = true;
+
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	if( port->RxStalled && !(port->UartConfig & MAX3140_CFG_ENABLE_TX_INT) )
+	{
+		port->RxReadPending = 1;
+		read = false;
+	}
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	if( read )
+	{
+		// dev_lock is not held here, the read can be polled
+		rpc_spi_transfer_deferrable_unlocked( port, RPC_DEFER_READ_DATA );
+	}
+}
+
+/* Pass the collected bytes to the tty, called at the end of a burst.
+ */
+static void rpc_rx_flush( RaspiCommPort_t* port )
+{
+	unsigned long spinlock_flags;
+
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	rpc_rx_flush_locked( port );
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+}
+
+static enum hrtimer_restart rx_flush_timer_expired( struct hrtimer *timer )
+{
+	rpc_rx_flush( container_of( timer, RaspiCommPort_t, rx_flush_timer ) );
+	return HRTIMER_NORESTART;
+}
+
+// this function collects a received character for the opened tty device,
+// called by the interrupt function
+static void raspicomm_rs485_received( RaspiCommPort_t* port,
+				struct tty_struct* tty, int c )
+{
+	unsigned long spinlock_flags;
+	unsigned int limit;
+	char flag = TTY_NORMAL;
+
+	LOG( "raspicomm_rs485_received(c=%03X)", c & 0x1FF );
+
+	if( tty == NULL || tty->port == NULL )
+	{
+		return;
+	}
+	limit = clamp_t( unsigned int, rx_batch_size, 1, RX_BATCH_MAX );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	if( port->RxBatchCount == 0 && limit > 1 )
+	{
+		// the first byte starts the time limit
+		hrtimer_start( &port->rx_flush_timer,
+				ktime_set( 0, ktime_to_ns( port->OneCharDelay ) *
+							max( rx_flush_chars, 1u ) ),
+				rpc_hrtimer_mode( HRTIMER_MODE_REL ) );
+	}
+	if( c & MAX3140_RX_FRAMING_ERROR )
+	{
+		port->RxFrameErrors++;
+		flag = TTY_FRAME;
+	}
+	else if( (port->UartConfig & MAX3140_CFG_ENABLE_PARITY) &&
+			((port->TxWriteCmds[c & 0xFF] ^ c) & MAX3140_RX_PARITY_BIT) )
+	{
+		// the WrDat command of the byte carries the parity bit expected
+		// for it
+		port->RxParityErrors++;
+		flag = TTY_PARITY;
+	}
+	port->RxBatch[port->RxBatchCount] = c;
+	port->RxBatchFlags[port->RxBatchCount] = flag;
+	port->RxBatchCount++;
+	if( port->RxBatchCount >= limit )
+	{
+		rpc_rx_flush_locked( port );
+	}
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+}
+
+// }}} raspicomm private function
+//============================================================================
+// {{{ TTY Interface Functions
+
+// the tty_port of each line is embedded in its RaspiComm port
+static inline RaspiCommPort_t* rpc_tty_port( struct tty_struct* tty )
+{
+	return container_of( tty->port, RaspiCommPort_t, tty_port );
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,7,0)
+#define rpc_qos_add( req, us )		cpu_latency_qos_add_request( req, us )
+#define rpc_qos_update( req, us )	cpu_latency_qos_update_request( req, us )
+#define rpc_qos_remove( req )		cpu_latency_qos_remove_request( req )
+#define rpc_qos_active( req )		cpu_latency_qos_request_active( req )
+#else
+#define rpc_qos_add( req, us ) \
+		pm_qos_add_request( req, PM_QOS_CPU_DMA_LATENCY, us )
+#define rpc_qos_update( req, us )	pm_qos_update_request( req, us )
+#define rpc_qos_remove( req )		pm_qos_remove_request( req )
+#define rpc_qos_active( req )		pm_qos_request_active( req )
+#endif
+
+/* Limit the wakeup latency of the CPUs to rx_qos_percent of the time the
+ * receive FIFO of the MAX3140 takes to fill at the current baud rate, so
+ * an interrupt is served before bytes get lost. Only applied while the
+ * port is open, the limit follows the baud rate and the parameter.
+ */
+static void rpc_port_qos_update( RaspiCommPort_t* port )
+{
+	unsigned int percent = min( READ_ONCE( rx_qos_percent ), 100u );
+	s32 us;
+
+	mutex_lock( &port->QosLock );
+	if( !port->tty_opened || percent == 0 )
+	{
+		if( rpc_qos_active( &port->LatencyQos ) )
+		{
+			rpc_qos_remove( &port->LatencyQos );
+		}
+		mutex_unlock( &port->QosLock );
+		return;
+	}
+	us = max_t( s32, div_u64( (u64)ktime_to_ns( port->OneCharDelay ) *
+				MAX3140_RX_FIFO_SIZE * percent, 100 * NSEC_PER_USEC ), 1 );
+	if( !rpc_qos_active( &port->LatencyQos ) )
+	{
+		rpc_qos_add( &port->LatencyQos, us );
+	}
+	else if( us != port->LatencyQosUs )
+	{
+		rpc_qos_update( &port->LatencyQos, us );
+	}
+	port->LatencyQosUs = us;
+	mutex_unlock( &port->QosLock );
+}
+
+/* Drop the wakeup latency limit, the CPUs may sleep deeply again.
+ */
+static void rpc_port_qos_remove( RaspiCommPort_t* port )
+{
+	mutex_lock( &port->QosLock );
+	if( rpc_qos_active( &port->LatencyQos ) )
+	{
+		rpc_qos_remove( &port->LatencyQos );
+	}
+	mutex_unlock( &port->QosLock );
+}
+
+// called by the kernel when open() is called for the device
+static int rpc_tty_open( struct tty_struct* tty, struct file* file )
+{
+	RaspiCommPort_t* port = rpc_tty_port( tty );
+
+	LOG_DBG( "rpc_tty_open() called" );
+
+	if( port->tty_opened )
+	{
+		LOG_ERR( "rpc_tty_open() was not successful as port->tty_opened != 0" );
+		return -ENODEV;
+	}
+	else
+	{
+		LOG_INFO( "rpc_tty_open() was successful" );
+
+		port->tty_open = tty;
+		port->tty_opened = 1;
+		rpc_port_qos_update( port );
+
+		return SUCCESS;
+	}
+}
+
+// called by the kernel when close() is called for the device
+static void rpc_tty_close( struct tty_struct* tty, struct file* file )
+{
+	RaspiCommPort_t* port = rpc_tty_port( tty );
+	unsigned long spinlock_flags;
+
+	LOG_DBG( "rpc_tty_close called" );
+	if( !port->tty_opened )
+	{
+		LOG_ERR( "rpc_tty_close: can't close device since it is already closed" );
+	}
+	else
+	{
+		// port->tty_open->driver_data = NULL;
+		// hand over what is left, the batch must not survive the close,
+		// bytes received after it find no tty
+		spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+		rpc_rx_flush_locked( port );
+		port->tty_open = NULL;
+		port->tty_opened = 0;
+		spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+		hrtimer_cancel( &port->rx_flush_timer );
+		rpc_port_qos_remove( port );
+		LOG_INFO( "rpc_tty_close: device was closed" );
+	}
+}
+
+static int rpc_tty_write( struct tty_struct* tty,
+	const unsigned char* buf, int count )
+{
+	RaspiCommPort_t* port = rpc_tty_port( tty );
+	unsigned long spinlock_flags;
 	int rc;
-	int data;
 
 	LOG( "rpc_tty_write(count=%i)", count );
 	if( count <= 0 )
 	{
 		return 0;
 	}
-	spin_lock_irqsave( &rcd.dev_lock, spinlock_flags );
-	if( rcd.UartConfig & MAX3140_BLOCK_COMMUNICATION )
+	if( READ_ONCE( port->UartConfig ) & MAX3140_BLOCK_COMMUNICATION )
 	{
 		// this device is gone
-		rc = -ENODEV;
+		return -ENODEV;
 	}
-	else
+	// the tty layer serializes the writers, so this is the only producer
+	// of the TX queue and needs no lock to add the bytes
+	// encode the bytes to WrDat commands on the way, the interrupt path
+	// only has to send them
+	rc = queue_enqueue_map( &port->TxQueue, buf, count,
+				READ_ONCE( port->TxWriteCmds ) );
+	if( trace_rpc_tx_queue_enabled() )
+	{
+		trace_rpc_tx_queue( port->index, rc,
+				queue_get_count( &port->TxQueue ) );
+	}
+	// pairs with the barrier in rpc_max3140_read_response(), either the
+	// transmit interrupt is seen off here or the bytes are seen there
+	smp_mb();
+	if( rc > 0 && !(READ_ONCE( port->UartConfig ) & MAX3140_CFG_ENABLE_TX_INT) )
 	{
-		rc = 0;
-		if( !(rcd.UartConfig & MAX3140_CFG_ENABLE_TX_INT) )
+		spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+		if( !(port->UartConfig &
+				(MAX3140_BLOCK_COMMUNICATION | MAX3140_CFG_ENABLE_TX_INT)) &&
+				!port->TxStopped )
 		{
 			// no transfer in progress or it is sending the last byte
-			LOG( "starting transfer" );
-			// send the first byte
-			data = rpc_max3140_make_write_data_cmd( buf[0] );
-			rcd.UartConfig |= MAX3140_CFG_ENABLE_TX_INT;
-			rpc_spi_transfer_word( rcd.UartConfig, start_transmitting_done2 );
-			rpc_spi_transfer_word( data, start_transmitting_done );
-			rc++;
-			// cancel a pending EOT
-			hrtimer_cancel( &rcd.last_byte_sent_timer );
-		}
-		// add the remaining bytes to the queue, stop if it is full
-		while( rc < count )
-		{
-			if( !queue_enqueue( &rcd.TxQueue, buf[rc] ) )
-			{
-				// queue full
-				break;
-			}
-			rc++;
+			rpc_max3140_tx_start( port );
 		}
+		spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
 	}
-	spin_unlock_irqrestore( &rcd.dev_lock, spinlock_flags );
 	LOG( "rpc_tty_write: %d", rc );
 	return rc;
 }
@@ -1005,42 +2837,61 @@ static int rpc_tty_write( struct tty_struct* tty,
 // called by kernel to evaluate how many bytes can be written
 static int rpc_tty_write_room( struct tty_struct *tty )
 {
-	unsigned long spinlock_flags;
-	int rc;
+	RaspiCommPort_t* port = rpc_tty_port( tty );
 
-	spin_lock_irqsave( &rcd.dev_lock, spinlock_flags );
-	if( rcd.UartConfig & MAX3140_BLOCK_COMMUNICATION )
+	if( READ_ONCE( port->UartConfig ) & MAX3140_BLOCK_COMMUNICATION )
 	{
-		rc = 0;
-	}
-	else
-	{
-		rc = queue_get_room( &rcd.TxQueue );
+		return 0;
 	}
-	spin_unlock_irqrestore( &rcd.dev_lock, spinlock_flags );
-	return rc;
+	return queue_get_room( &port->TxQueue );
 }
 
+/* Drop the queued bytes and the WrDat commands which have not been started
+ * yet. The byte in the MAX3140 is sent, the transmission ends as usual.
+ */
 static void rpc_tty_flush_buffer( struct tty_struct * tty )
 {
+	RaspiCommPort_t* port = rpc_tty_port( tty );
+	unsigned long spinlock_flags;
+
 	LOG( "rpc_tty_flush_buffer called" );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	queue_clear( &port->TxQueue );
+	rpc_spi_drop_tx_data( port );
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	tty_wakeup( tty );
 }
 
+/* The queued bytes plus one for the byte in the MAX3140 and the turnaround,
+ * tcdrain() waits for this to become 0.
+ */
 static int rpc_tty_chars_in_buffer( struct tty_struct * tty )
 {
-	unsigned long spinlock_flags;
-	int rc;
+	RaspiCommPort_t* port = rpc_tty_port( tty );
 
-	spin_lock_irqsave( &rcd.dev_lock, spinlock_flags );
-	rc = QUEUE_SIZE - 1 - queue_get_room( &rcd.TxQueue );
-	spin_unlock_irqrestore( &rcd.dev_lock, spinlock_flags );
-	return rc;
+	return queue_get_count( &port->TxQueue ) + (READ_ONCE( port->TxActive ) ? 1 : 0);
+}
+
+/* Wait until the last byte is on the wire and receive mode is restored,
+ * the timeout is in jiffies, 0 waits forever.
+ */
+static void rpc_tty_wait_until_sent( struct tty_struct * tty, int timeout )
+{
+	RaspiCommPort_t* port = rpc_tty_port( tty );
+
+	LOG( "rpc_tty_wait_until_sent(timeout=%d)", timeout );
+	if( READ_ONCE( port->TxActive ) )
+	{
+		wait_for_completion_interruptible_timeout( &port->tx_done,
+				timeout ? timeout : MAX_SCHEDULE_TIMEOUT );
+	}
 }
 
 // called by the kernel when cfsetattr() is called from userspace
 static void rpc_tty_set_termios( struct tty_struct* tty,
 				struct ktermios* kt )
 {
+	RaspiCommPort_t* port = rpc_tty_port( tty );
 	unsigned long spinlock_flags;
 	int rc;
 	int cflag;
@@ -1050,9 +2901,9 @@ static void rpc_tty_set_termios( struct tty_struct* tty,
 	Stopbits stopbits;
 
 	LOG( "rpc_tty_set_termios() called" );
-	spin_lock_irqsave( &rcd.dev_lock, spinlock_flags );
-	rc = (rcd.UartConfig & MAX3140_BLOCK_COMMUNICATION);
-	spin_unlock_irqrestore( &rcd.dev_lock, spinlock_flags );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	rc = (port->UartConfig & MAX3140_BLOCK_COMMUNICATION);
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
 	if( rc )
 	{
 		LOG( "rpc_tty_set_termios() call not allowed" );
@@ -1094,17 +2945,63 @@ static void rpc_tty_set_termios( struct tty_struct* tty,
 	}
 
 	// update the configuration
-	rpc_max3140_configure( baudrate, databits, stopbits, parity );
+	rpc_max3140_configure( port, baudrate, databits, stopbits, parity );
+	rpc_port_qos_update( port );
 }
 
+// called by the kernel to stop the output, e.g. after XOFF
+// the byte in the MAX3140 and an already queued WrDat are still sent
 static void rpc_tty_stop( struct tty_struct * tty )
 {
+	RaspiCommPort_t* port = rpc_tty_port( tty );
+	unsigned long spinlock_flags;
+
 	LOG( "rpc_tty_stop called" );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	if( !port->TxStopped )
+	{
+		port->TxStopped = 1;
+		port->TxStops++;
+		if( port->UartConfig & MAX3140_CFG_ENABLE_TX_INT )
+		{
+			// the next T response ends the frame instead of sending,
+			// the read finds it if the transmit buffer is empty already
+			port->TxPaused = 1;
+			rpc_spi_transfer_deferrable( port, RPC_DEFER_TX_KICK );
+		}
+	}
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
 }
 
+// called by the kernel to restart the output
 static void rpc_tty_start( struct tty_struct * tty )
 {
+	RaspiCommPort_t* port = rpc_tty_port( tty );
+	unsigned long spinlock_flags;
+
 	LOG( "rpc_tty_start called" );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	port->TxStopped = 0;
+	if( port->UartConfig & MAX3140_BLOCK_COMMUNICATION )
+	{
+		// the device is gone
+	}
+	else if( !(port->UartConfig & MAX3140_CFG_ENABLE_TX_INT) )
+	{
+		// the frame has ended while stopped, switch back to transmit
+		// mode for the bytes left or written meanwhile
+		port->TxPaused = 0;
+		if( !queue_is_empty( &port->TxQueue ) )
+		{
+			rpc_max3140_tx_start( port );
+		}
+	}
+	else
+	{
+		// the frame has not ended yet, the TX chain continues
+		port->TxPaused = 0;
+	}
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
 }
 
 static void rpc_tty_hangup( struct tty_struct * tty )
@@ -1125,15 +3022,54 @@ static int rpc_tty_tiocmset( struct tty_struct *tty,
 	return 0;
 }
 
+/* TIOCSRS485, only the delays can be changed, they are in milliseconds as
+ * for all serial drivers. The adjusted settings are passed back.
+ */
+static int rpc_tty_set_rs485( RaspiCommPort_t* port,
+				struct serial_rs485 __user* arg )
+{
+	unsigned long spinlock_flags;
+	struct serial_rs485 rs485;
+
+	if( copy_from_user( &rs485, arg, sizeof(rs485) ) )
+	{
+		return -EFAULT;
+	}
+	// the board is always RS485, the driver is enabled while sending
+	rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+	rs485.delay_rts_before_send = min( rs485.delay_rts_before_send, 100u );
+	rs485.delay_rts_after_send = min( rs485.delay_rts_after_send, 100u );
+	memset( rs485.padding, 0, sizeof(rs485.padding) );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	port->Rs485 = rs485;
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	return copy_to_user( arg, &rs485, sizeof(rs485) ) ? -EFAULT : 0;
+}
+
 // called by the kernel to get/set data
 static int rpc_tty_ioctl( struct tty_struct* tty,
 								unsigned int cmd, unsigned int long arg )
 {
+	RaspiCommPort_t* port = rpc_tty_port( tty );
+	unsigned long spinlock_flags;
+	struct serial_rs485 rs485;
 	int ret;
 
 	LOG( "rpc_tty_ioctl() called with cmd=%X, arg=%lX", cmd, arg );
 	switch( cmd )
 	{
+		case TIOCSRS485:
+			ret = rpc_tty_set_rs485( port, (struct serial_rs485 __user*)arg );
+			break;
+
+		case TIOCGRS485:
+			spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+			rs485 = port->Rs485;
+			spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+			ret = copy_to_user( (struct serial_rs485 __user*)arg,
+						&rs485, sizeof(rs485) ) ? -EFAULT : 0;
+			break;
+
 		case TIOCMSET:
 		case TIOCMGET:
 			// ioctl to get and set DTR, DSR, RTS, CTS, etc...
@@ -1147,14 +3083,128 @@ static int rpc_tty_ioctl( struct tty_struct* tty,
 	return ret;
 }
 
+/* Collect the counters of a port.
+ */
+static void rpc_port_get_counters( RaspiCommPort_t* port,
+				rpc_port_counters_t* c )
+{
+	unsigned long spinlock_flags;
+	int cls;
+
+	memset( c, 0, sizeof(*c) );
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	c->rx = port->RxBytes;
+	c->spi_transfers = port->SpiTransfers;
+	c->spi_irqs = port->SpiIrqs;
+	c->spi_fifo_errors = port->SpiFifoErrors;
+	c->spi_retries = port->SpiRetries;
+	c->spi_give_ups = port->SpiGiveUps;
+	c->resyncs = port->Resyncs;
+	c->resync_mismatches = port->ResyncMismatches;
+	for( cls = 0; cls < RPC_SPI_CLASS_COUNT; cls++ )
+	{
+		c->rejected += port->queues[cls].rejected;
+		c->high_water = max( c->high_water, port->queues[cls].high_water );
+	}
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	c->tx = port->TxBytes;
+	c->frame = port->RxFrameErrors;
+	c->parity = port->RxParityErrors;
+	c->overrun = port->RxOverruns;
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	c->gpio_irqs = READ_ONCE( port->GpioIrqs );
+}
+
+// called by the kernel for TIOCGICOUNT
+static int rpc_tty_get_icount( struct tty_struct* tty,
+				struct serial_icounter_struct* icount )
+{
+	rpc_port_counters_t c;
+
+	rpc_port_get_counters( rpc_tty_port( tty ), &c );
+	icount->rx = c.rx;
+	icount->tx = c.tx;
+	icount->frame = c.frame;
+	icount->parity = c.parity;
+	// the MAX3140 does not report FIFO overruns, only bytes lost in the
+	// driver and the tty buffer are known
+	icount->buf_overrun = c.overrun;
+	return 0;
+}
+
+// called by the kernel when the tty buffer is getting full
 static void rpc_tty_throttle( struct tty_struct * tty )
 {
+	RaspiCommPort_t* port = rpc_tty_port( tty );
+	unsigned long spinlock_flags;
+
 	LOG( "throttle" );
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	if( !port->RxThrottled )
+	{
+		port->RxThrottled = 1;
+		port->RxThrottles++;
+	}
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
 }
 
+// called by the kernel when the tty buffer has room again, the held bytes
+// are passed and reading resumes
 static void rpc_tty_unthrottle( struct tty_struct * tty )
 {
+	RaspiCommPort_t* port = rpc_tty_port( tty );
+	unsigned long spinlock_flags;
+	uint16_t items[RX_HOLD_CHUNK];
+	unsigned char chars[RX_HOLD_CHUNK];
+	char flags[RX_HOLD_CHUNK];
+	unsigned int n, i;
+	unsigned int lost = 0;
+	int read;
+
 	LOG( "unthrottle" );
+	for( ;; )
+	{
+		// this is the only consumer of RxHold, it is emptied in chunks
+		// without dev_lock, new bytes still go to it while throttled
+		// so the order is kept
+		n = queue_dequeue_n( &port->RxHold, items, RX_HOLD_CHUNK );
+		for( i = 0; i < n; i++ )
+		{
+			chars[i] = items[i] & 0xFF;
+			flags[i] = items[i] >> 8;
+		}
+		if( n > 0 )
+		{
+			// bytes the flip buffer has no room for are lost
+			lost += n - tty_insert_flip_string_flags( tty->port, chars,
+					flags, n );
+		}
+		spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+		if( queue_is_empty( &port->RxHold ) )
+		{
+			// the bytes collected from now on go to the tty again
+			break;
+		}
+		spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	}
+	port->RxThrottled = 0;
+	port->RxOverruns += lost;
+	if( port->RxHoldOverrun )
+	{
+		port->RxHoldOverrun = 0;
+		tty_insert_flip_char( tty->port, 0, TTY_OVERRUN );
+	}
+	port->RxStalled = 0;
+	read = port->RxReadPending;
+	port->RxReadPending = 0;
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	tty_flip_buffer_push( tty->port );
+	if( read )
+	{
+		rpc_spi_transfer_deferrable( port, RPC_DEFER_READ_DATA );
+	}
 }
 
 // }}} TTY Interface Functions
@@ -1205,21 +3255,51 @@ static void rpc_spi_reset(void)
 	rpc_spi_write_reg( BCM2835_SPI_CS, SPI_CS_DONE );
 }
 
+/* Number of transfers in the ring of a class, spi_lock must be held.
+ */
+static inline unsigned int rpc_spi_transfer_count( RaspiCommPort_t* port,
+				rpc_spi_class_t cls )
+{
+	return port->queues[cls].tail - port->queues[cls].head;
+}
+
 static void rpc_spi_cancel_transfers_and_wait(void)
 {
 	unsigned long spinlock_flags;
 	int n = 100;
 	int tcnt = 1;
+	int cls;
+	unsigned int i;
 
 	while( n > 0 )
 	{
-		spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
-		if( rcd.transfer_count > 1 )
+		raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+		// drop everything except the transfer in progress
+		tcnt = 0;
+		for( i = 0; i < rcd.port_count; i++ )
 		{
-			rcd.transfer_count = 1;
+			RaspiCommPort_t* port = rcd.ports[i];
+
+			port->transfer_deferred = 0;
+			port->RxBurstLeft = 0;
+			for( cls = 0; cls < RPC_SPI_CLASS_COUNT; cls++ )
+			{
+				rpc_spi_queue_t* q = &port->queues[cls];
+				if( !rcd.transfer_in_progress || port != rcd.transfer_port ||
+						cls != rcd.transfer_class )
+				{
+					q->tail = q->head;
+				}
+				else if( rpc_spi_transfer_count( port, cls ) > 1 )
+				{
+					q->tail = q->head + 1;
+				}
+				tcnt += rpc_spi_transfer_count( port, cls );
+			}
 		}
-		tcnt = rcd.transfer_count;
-		spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+		// callbacks waiting for the interrupt thread
+		tcnt += rcd.done_tail - rcd.done_head;
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
 		if( tcnt > 0 )
 		{
 			msleep( 1 );
@@ -1237,203 +3317,2043 @@ static void rpc_spi_cancel_transfers_and_wait(void)
 	}
 }
 
-/* Start a transfer if there is one and none is in progress.
- * To be called only by rpc_spi_interrupt() and rpc_spi_transfer_word().
+static void rpc_spi_queue_deferred( RaspiCommPort_t* port );
+static bool rpc_spi_enqueue( RaspiCommPort_t* port, rpc_spi_class_t cls,
+				uint16_t send_data, bool current_config,
+				rpc_spi_callback_t callback );
+
+/* Remove the reads of a cancelled RX burst from the head of the RX ring,
+ * spi_lock must be held and no transfer may be in progress.
  */
-static bool rpc_spi_start_transfer(void)
+static void rpc_spi_drop_cancelled_reads( RaspiCommPort_t* port )
 {
-	unsigned long spinlock_flags;
-	bool rc = true;
+	rpc_spi_queue_t* q = &port->queues[RPC_SPI_CLASS_RX];
 
-	spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
-	if( rcd.transfer_count == 0 )
+	while( q->head != q->tail )
 	{
-		// no transfers to start
+		rpc_spi_transfer_t* t = &q->transfers[q->head & rcd.transfer_mask];
+		if( !t->burst || t->burst != port->RxBurstCancelled )
+		{
+			break;
+		}
+		q->head++;
 	}
-	else if( rpc_spi_read_reg( BCM2835_SPI_CS ) & BCM2835_SPI_CS_INTD )
+}
+
+/* Turn the queued WrDat commands carrying data into ones which do not
+ * transmit, for flushing the output. The transfer in progress is kept.
+ * The callbacks still run, so the TX chain ends as usual.
+ */
+static void rpc_spi_drop_tx_data( RaspiCommPort_t* port )
+{
+	unsigned long spinlock_flags;
+	rpc_spi_queue_t* q = &port->queues[RPC_SPI_CLASS_TX];
+	unsigned int i;
+
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	i = q->head;
+	if( rcd.transfer_in_progress && rcd.transfer_port == port &&
+			rcd.transfer_class == RPC_SPI_CLASS_TX )
 	{
-		// a transfer is already in progress
+		i++;
 	}
-	else
+	for( ; i != q->tail; i++ )
 	{
-		uint16_t data = rcd.transfers[0].send_data;
-		// set Transfer Active flag
-		rpc_spi_write_reg( BCM2835_SPI_CS, SPI_CS_START );
+		rpc_spi_transfer_t* t = &q->transfers[i & rcd.transfer_mask];
+		if( !t->current_config &&
+				(t->send_data & MAX3140_CMD_WRITE_CONFIG) ==
+						MAX3140_CMD_WRITE_DATA )
+		{
+			t->send_data |= MAX3140_WRDAT_DO_NOT_TRANSMIT;
+		}
+	}
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+}
+
+/* Find the port whose transfer goes next, spi_lock must be held. The highest
+ * class wins, within a class the ports take turns starting after the one
+ * served last, so a busy port cannot starve the others.
+ * Returns NULL if no transfer is queued.
+ */
+static RaspiCommPort_t* rpc_spi_next_port( rpc_spi_class_t* cls )
+{
+	RaspiCommPort_t* port;
+	unsigned int last = rcd.transfer_port ? rcd.transfer_port->index : 0;
+	unsigned int i;
+	int c;
+
+	for( i = 0; i < rcd.port_count; i++ )
+	{
+		rpc_spi_drop_cancelled_reads( rcd.ports[i] );
+	}
+	for( c = 0; c < RPC_SPI_CLASS_COUNT; c++ )
+	{
+		for( i = 1; i <= rcd.port_count; i++ )
+		{
+			port = rcd.ports[(last + i) % rcd.port_count];
+			if( rpc_spi_transfer_count( port, c ) > 0 )
+			{
+				*cls = c;
+				return port;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Push the deadline of the watchdog out for a transfer completed by the
+ * interrupt, spi_lock must be held. The timer is only started if it is not
+ * running, when it expires early it moves on to the new deadline.
+ */
+static void rpc_spi_watchdog_arm_locked(void)
+{
+	rcd.spi_watchdog_deadline = ktime_add_ns( ktime_get(),
+			4 * (u64)rcd.spi_word_ns + SPI_WATCHDOG_SLACK_NS );
+	if( !rcd.spi_watchdog_armed )
+	{
+		rcd.spi_watchdog_armed = true;
+		hrtimer_start( &rcd.spi_watchdog, rcd.spi_watchdog_deadline,
+				rpc_hrtimer_mode( HRTIMER_MODE_ABS ) );
+	}
+}
+
+/* Start the next transfer if there is one and none is in progress, spi_lock
+ * must be held. The transfer is polled if its expected time fits into the
+ * remaining poll budget, else it completes with the interrupt.
+ * Returns true if the started transfer has to be polled by the caller.
+ */
+static bool rpc_spi_start_next( unsigned int* poll_budget_ns )
+{
+	RaspiCommPort_t* port;
+	rpc_spi_class_t cls;
+	bool polled = false;
+
+	if( rcd.transfer_polled ||
+			(rpc_spi_read_reg( BCM2835_SPI_CS ) & BCM2835_SPI_CS_INTD) )
+	{
+		// a transfer is already in progress
+		return false;
+	}
+	if( rcd.done_tail - rcd.done_head >= RPC_SPI_DONE_SIZE )
+	{
+		// the interrupt thread has to catch up first
+		return false;
+	}
+	port = rpc_spi_next_port( &cls );
+	if( port == NULL )
+	{
+		// no transfers to start
+	}
+	else
+	{
+		rpc_spi_queue_t* q = &port->queues[cls];
+		rpc_spi_transfer_t* t = &q->transfers[q->head & rcd.transfer_mask];
+		uint16_t data;
+
+		if( t->current_config )
+		{
+			t->send_data = READ_ONCE(port->UartConfig);
+		}
+		data = t->send_data;
+		rcd.transfer_port = port;
+		rcd.transfer_class = cls;
+		if( rcd.spi_cdiv_dirty )
+		{
+			// the clock has changed, no transfer is running now
+			rpc_spi_write_reg( BCM2835_SPI_CLK, rcd.spi_cdiv );
+			rcd.spi_cdiv_dirty = false;
+		}
+		polled = *poll_budget_ns >= rcd.spi_word_ns;
+		// set Transfer Active flag and select the MAX3140 of the port
+		rpc_spi_write_reg( BCM2835_SPI_CS,
+				(polled ? SPI_CS_START_POLL : SPI_CS_START) | port->cs );
 		if( !rpc_spi_write_fifo( data>>8 ) )
 		{
 			// writing to FIFO failed
-			rc = false;
+			polled = false;
 			rpc_spi_reset();
 			LOG_ERR( "rpc_spi_start_transfer: writing byte 1 FIFO failed" );
 		}
 		else if( !rpc_spi_write_fifo( data ) )
 		{
 			// writing to FIFO failed
-			rc = false;
+			polled = false;
 			rpc_spi_reset();
 			LOG_ERR( "rpc_spi_start_transfer: writing byte 2 FIFO failed" );
 		}
 		else
 		{
-			LOG( "rpc_spi_start_transfer: wrote %04X", data );
-			rcd.transfer_in_progress = true;
+			LOG( "rpc_spi_start_transfer: wrote %04X to ttyRPC%u",
+					data, port->index );
+			trace_rpc_spi_start( port->index, cls, data, polled );
+			rcd.transfer_in_progress = true;
+			rcd.transfer_cpu = raw_smp_processor_id();
+			rcd.transfer_polled = polled;
+			if( polled )
+			{
+				*poll_budget_ns -= rcd.spi_word_ns;
+			}
+			else
+			{
+				rpc_spi_watchdog_arm_locked();
+				if( rcd.calib_cur )
+				{
+					rcd.calib_t0 = ktime_get();
+				}
+			}
+			if( t->queued )
+			{
+				// first start of this transfer, account its wait time
+				ktime_t now = ktime_get();
+				u64 wait = ktime_to_ns( ktime_sub( now, t->queued ) );
+
+				rpc_lat_spi_started( port, data, now );
+				t->queued = 0;
+				q->started++;
+				q->wait_total_ns += wait;
+				if( wait > q->wait_max_ns )
+				{
+					q->wait_max_ns = wait;
+				}
+			}
+		}
+	}
+	return polled;
+}
+
+/* Add a completed transfer to the flight recorder, spi_lock must be held.
+ */
+static inline void rpc_rec_add( RaspiCommPort_t* port,
+				const rpc_spi_transfer_t* t, uint32_t cs, unsigned int depth,
+				unsigned int flags, ktime_t now )
+{
+	rpc_rec_t* r;
+
+	if( rcd.rec_frozen )
+	{
+		return;
+	}
+	r = &rcd.rec[rcd.rec_head & (RPC_REC_SIZE - 1)];
+	r->ns = ktime_to_ns( now );
+	r->sent = t->send_data;
+	r->rcvd = t->recv_data;
+	r->cs = cs;
+	r->port = port->index;
+	r->cls = rcd.transfer_class;
+	r->depth = depth;
+	r->flags = flags;
+	rcd.rec_head++;
+	if( (flags & RPC_REC_ERROR) && !rcd.rec_stopping )
+	{
+		// keep what led to the error and how it went on
+		rcd.rec_stopping = true;
+		rcd.rec_stop_at = rcd.rec_head + RPC_REC_AFTER_ERROR;
+	}
+	else if( rcd.rec_stopping && rcd.rec_head == rcd.rec_stop_at )
+	{
+		rcd.rec_frozen = true;
+		LOG_INFO( "SPI flight recorder frozen after an error" );
+	}
+}
+
+/* Response of the RdCfg queued after a FIFO error. The lost response may
+ * have belonged to a WrCfg, if the MAX3140 has not taken the config it is
+ * written again.
+ */
+static void rpc_spi_resync_done( RaspiCommPort_t* port,
+				uint16_t send_data, uint16_t recv_data )
+{
+	unsigned long spinlock_flags;
+	bool mismatch;
+
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	mismatch = (recv_data & MAX3140_CONFIG_READBACK_MASK) !=
+			(port->UartConfig & MAX3140_CONFIG_READBACK_MASK);
+	if( mismatch && !(port->UartConfig & MAX3140_BLOCK_COMMUNICATION) )
+	{
+		rpc_spi_transfer_deferrable( port, RPC_DEFER_WRITE_CONFIG );
+	}
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	port->ResyncQueued = false;
+	port->Resyncs++;
+	if( mismatch )
+	{
+		port->ResyncMismatches++;
+	}
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	if( mismatch )
+	{
+		LOG_ERR( "ttyRPC%u: config %04X read back after a FIFO error, "
+				"writing it again", port->index, recv_data );
+	}
+}
+
+/* Change the SPI clock while recovering from FIFO errors, spi_lock must be
+ * held.
+ */
+static void rpc_spi_shift_clock_locked( unsigned int hz )
+{
+	LOG_INFO( "spi clock %u Hz -> %u Hz (fifo errors)",
+			rcd.spi_target_hz, hz );
+	rcd.spi_target_hz = hz;
+	rpc_spi_update_clock_locked();
+}
+
+/* A response could not be read, spi_lock must be held. The state of the
+ * controller is kept and the clock is halved if the errors pile up.
+ */
+static void rpc_spi_fifo_error_locked( RaspiCommPort_t* port,
+				const rpc_spi_transfer_t* t, uint8_t read_err, uint32_t cs,
+				ktime_t now )
+{
+	rpc_spi_error_t* e;
+
+	rcd.fifo_errors++;
+	port->SpiFifoErrors++;
+	rcd.err_last = now;
+
+	e = &rcd.spi_errors[rcd.spi_error_head++ % RPC_SPI_ERROR_SNAPSHOTS];
+	e->time = now;
+	e->sent = t->send_data;
+	e->port = port->index;
+	e->read_err = read_err;
+	e->cs = cs;
+	rpc_spi_write_reg( BCM2835_SPI_CS, SPI_CS_RESET );
+	e->cs_reset = rpc_spi_read_reg( BCM2835_SPI_CS );
+
+	if( spi_downshift_errors == 0 || rcd.calibrating )
+	{
+		return;
+	}
+	if( ktime_to_ns( ktime_sub( now, rcd.err_window ) ) > NSEC_PER_SEC )
+	{
+		rcd.err_window = now;
+		rcd.err_window_count = 0;
+	}
+	if( ++rcd.err_window_count >= spi_downshift_errors &&
+			rcd.spi_target_hz / 2 >= SPI_MIN_HZ )
+	{
+		rpc_spi_shift_clock_locked( rcd.spi_target_hz / 2 );
+		rcd.spi_downshifts++;
+		rcd.err_window_count = 0;
+	}
+}
+
+/* Raise a lowered SPI clock one step after a quiet period, spi_lock must be
+ * held.
+ */
+static inline void rpc_spi_upshift_locked( ktime_t now )
+{
+	if( rcd.spi_target_hz < rcd.spi_nominal_hz && !rcd.calibrating &&
+			ktime_after( now, ktime_add_ms( rcd.err_last,
+						spi_downshift_quiet_ms ) ) )
+	{
+		rpc_spi_shift_clock_locked( min( rcd.spi_target_hz * 2,
+					rcd.spi_nominal_hz ) );
+		rcd.spi_upshifts++;
+		// the next step needs another quiet period
+		rcd.err_last = now;
+	}
+}
+
+/* Decode the response of a completed transfer, call its callback and fill
+ * the free slot of the ring with deferred transfers. spi_lock must not be
+ * held, the callbacks take dev_lock.
+ */
+static void rpc_spi_run_callback( RaspiCommPort_t* port,
+				const rpc_spi_transfer_t* t, bool failed )
+{
+	unsigned long spinlock_flags;
+
+	if( !failed )
+	{
+#ifdef DEBUG
+		log_max3140_message( t->send_data, t->recv_data, 0 );
+#endif
+		rpc_max3140_response( port, t->send_data, t->recv_data );
+	}
+	else if( !(t->send_data & MAX3140_CMD_READ_CONFIG) )
+	{
+		// the received byte a data command returned is lost, count it
+		spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+		port->RxOverruns++;
+		spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	}
+	if( t->callback )
+	{
+		t->callback( port, t->send_data, t->recv_data );
+	}
+
+	// a slot is free now, queue the deferred transfers
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	rpc_spi_queue_deferred( port );
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+}
+
+/* In threaded mode pass a completed transfer to the interrupt thread,
+ * spi_lock must be held. rpc_spi_start_next() leaves room for it.
+ * Returns false if the caller has to call the callback itself.
+ */
+static bool rpc_spi_done_push_locked( RaspiCommPort_t* port,
+				const rpc_spi_transfer_t* t, bool failed )
+{
+	rpc_spi_done_t* d;
+
+	if( !rcd.threaded )
+	{
+		return false;
+	}
+	d = &rcd.done[rcd.done_tail & (RPC_SPI_DONE_SIZE - 1)];
+	d->port = port;
+	d->t = *t;
+	d->failed = failed;
+	d->cpu = rcd.complete_cpu;
+	rcd.done_tail++;
+	return true;
+}
+
+/* Returns true if completed transfers wait for the interrupt thread.
+ */
+static inline bool rpc_spi_done_pending(void)
+{
+	return READ_ONCE( rcd.done_tail ) != READ_ONCE( rcd.done_head );
+}
+
+/* Finish the transfer in progress: read the response, remove it from the
+ * ring and call its callback. Called by the interrupt or the polling loop,
+ * in threaded mode the callback is left to the interrupt thread.
+ */
+static void rpc_spi_complete_transfer(void)
+{
+	unsigned long spinlock_flags;
+	uint8_t h, l;
+	RaspiCommPort_t* port;
+	rpc_spi_queue_t* q;
+	rpc_spi_transfer_t t;
+	uint8_t read_err;
+	uint32_t cs;
+	ktime_t now;
+	bool retry;
+	bool deferred;
+
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	cs = rpc_spi_read_reg( BCM2835_SPI_CS );
+	if( !rcd.transfer_in_progress || !(cs & BCM2835_SPI_CS_DONE) )
+	{
+		// the watchdog has completed it already
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+		return;
+	}
+	now = ktime_get();
+	rcd.complete_cpu = raw_smp_processor_id();
+	if( rcd.complete_cpu != rcd.transfer_cpu )
+	{
+		rcd.spi_cross_cpu++;
+	}
+	if( rcd.calib_t0 )
+	{
+		// interrupt latency for the calibration
+		rpc_calib_result_t* r = rcd.calib_cur;
+		s64 ns = ktime_to_ns( ktime_sub( now, rcd.calib_t0 ) ) -
+				rcd.spi_word_ns;
+
+		rcd.calib_t0 = 0;
+		if( r )
+		{
+			ns = max_t( s64, ns, 0 );
+			r->irq_count++;
+			r->irq_total_ns += ns;
+			r->irq_max_ns = max_t( u64, r->irq_max_ns, ns );
+		}
+	}
+	port = rcd.transfer_port;
+	q = &port->queues[rcd.transfer_class];
+	t = q->transfers[q->head & rcd.transfer_mask];
+	if( rcd.transfer_class == RPC_SPI_CLASS_TX )
+	{
+		port->TxSpiTransfers++;
+	}
+
+	read_err = 0;
+	h = l = 0;
+	if( !rpc_spi_read_fifo( &h ) )
+	{
+		read_err |= 0x10;
+	}
+	if( !rpc_spi_read_fifo( &l ) )
+	{
+		read_err |= 0x01;
+	}
+	t.recv_data = h<<8 | l;
+	rpc_spi_write_reg( BCM2835_SPI_CS, SPI_CS_DONE );
+	rpc_rec_add( port, &t, cs, rpc_spi_transfer_count( port, rcd.transfer_class ),
+			(read_err ? RPC_REC_ERROR : 0) |
+			(t.retries ? RPC_REC_RETRY : 0) |
+			(rcd.transfer_polled ? RPC_REC_POLLED : 0), now );
+	if( read_err == 0 )
+	{
+		trace_rpc_spi_complete( port->index, rcd.transfer_class, t.send_data,
+				t.recv_data, rcd.transfer_polled );
+	}
+	else
+	{
+		trace_rpc_spi_retry( port->index, rcd.transfer_class, t.send_data,
+				read_err );
+	}
+	if( rcd.transfer_polled )
+	{
+		rcd.transfers_polled++;
+	}
+	else
+	{
+		rcd.transfers_irq++;
+		port->SpiIrqs++;
+	}
+	rcd.transfer_in_progress = false;
+	rcd.transfer_polled = false;
+	if( read_err == 0 )
+	{
+		// SPI transfer finished, remove it from the ring
+		rpc_lat_spi_done( port, t.send_data, t.recv_data, now );
+		q->head++;
+		port->SpiTransfers++;
+		rpc_spi_upshift_locked( now );
+		deferred = rpc_spi_done_push_locked( port, &t, false );
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+		if( !deferred )
+		{
+			rpc_spi_run_callback( port, &t, false );
+		}
+	}
+	else
+	{
+		// the response could not be read, the MAX3140 has executed the
+		// command anyway: both data commands have popped a received byte,
+		// a WrDat has sent its byte and a WrCfg has changed the settings,
+		// only a RdCfg can be repeated
+		rpc_spi_fifo_error_locked( port, &t, read_err, cs, now );
+		retry = t.retries < spi_retry_max &&
+				(t.send_data & MAX3140_CMD_WRITE_CONFIG) == MAX3140_CMD_READ_CONFIG;
+		if( retry )
+		{
+			// try it again
+			q->transfers[q->head & rcd.transfer_mask].retries++;
+			port->SpiRetries++;
+		}
+		else
+		{
+			// complete it with an empty response
+			q->head++;
+			port->SpiGiveUps++;
+			t.recv_data = 0;
+		}
+		deferred = !retry && rpc_spi_done_push_locked( port, &t, true );
+		if( !port->ResyncQueued && rpc_spi_enqueue( port, RPC_SPI_CLASS_CFG,
+					MAX3140_CMD_READ_CONFIG, false, rpc_spi_resync_done ) )
+		{
+			// check that the MAX3140 still has the config of the driver
+			port->ResyncQueued = true;
+		}
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+		LOG_ERR( "rpc_spi_interrupt: error reading FIFO (%02X), %s",
+				read_err, retry ? "retrying" : "giving up" );
+		log_max3140_message( t.send_data, -1, 1 );
+		if( !retry && !deferred )
+		{
+			rpc_spi_run_callback( port, &t, true );
+		}
+	}
+}
+
+/* Spin until the polled transfer is done. If it takes much longer than
+ * expected the interrupt is enabled and completes it instead.
+ * Returns true if the transfer is done and has to be completed.
+ */
+static bool rpc_spi_poll_done(void)
+{
+	unsigned long spinlock_flags;
+	ktime_t timeout;
+	bool done;
+
+	timeout = ktime_add_ns( ktime_get(), 4 * rcd.spi_word_ns + 10000 );
+	while( !(rpc_spi_read_reg( BCM2835_SPI_CS ) & BCM2835_SPI_CS_DONE) )
+	{
+		if( ktime_after( ktime_get(), timeout ) )
+		{
+			break;
+		}
+		cpu_relax();
+	}
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	done = rpc_spi_read_reg( BCM2835_SPI_CS ) & BCM2835_SPI_CS_DONE;
+	if( !done )
+	{
+		// give up polling, the interrupt fires when DONE gets set
+		rcd.poll_timeouts++;
+		rcd.transfer_polled = false;
+		rpc_spi_write_reg( BCM2835_SPI_CS,
+				SPI_CS_START | rcd.transfer_port->cs );
+		rpc_spi_watchdog_arm_locked();
+	}
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	return done;
+}
+
+/* Start transfers as long as there are some and none is in progress.
+ * Short chains are polled and their callbacks are called from here if
+ * may_poll is set, the caller must not hold a dev_lock then. Only one
+ * context runs the polling loop, the others leave the work to it.
+ */
+static void rpc_spi_start_transfer( bool may_poll )
+{
+	unsigned long spinlock_flags;
+	unsigned int poll_budget_ns =
+			min( spi_poll_limit_us, 1000u ) * NSEC_PER_USEC;
+	bool polled;
+
+	if( rcd.threaded || !may_poll || READ_ONCE( rcd.calibrating ) )
+	{
+		// the caller may hold a dev_lock which the callbacks take
+		// again, leave the completion to the interrupt
+		// the calibration measures the interrupt, so it never polls
+		// in threaded mode the interrupt is short and polling would
+		// only add to the time spent with interrupts off
+		poll_budget_ns = 0;
+	}
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	if( rcd.poll_active )
+	{
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+		return;
+	}
+	polled = rpc_spi_start_next( &poll_budget_ns );
+	rcd.poll_active = polled;
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+
+	while( polled )
+	{
+		polled = rpc_spi_poll_done();
+		if( polled )
+		{
+			rpc_spi_complete_transfer();
+		}
+		raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+		if( polled )
+		{
+			// continue with the next one while the budget lasts
+			polled = rpc_spi_start_next( &poll_budget_ns );
+		}
+		rcd.poll_active = polled;
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	}
+}
+
+/* No completion arrived for the transfer in progress. If the controller is
+ * done only the interrupt got lost and the transfer is completed here,
+ * else the controller is reset and the transfer started again.
+ */
+static enum hrtimer_restart rpc_spi_watchdog_expired( struct hrtimer* timer )
+{
+	unsigned long spinlock_flags;
+	RaspiCommPort_t* port;
+	rpc_spi_queue_t* q;
+	uint32_t cs;
+	bool done;
+
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	if( rcd.transfer_in_progress && !rcd.transfer_polled &&
+			ktime_before( ktime_get(), rcd.spi_watchdog_deadline ) )
+	{
+		// a later transfer has moved the deadline
+		hrtimer_set_expires( timer, rcd.spi_watchdog_deadline );
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+		return HRTIMER_RESTART;
+	}
+	rcd.spi_watchdog_armed = false;
+	if( !rcd.transfer_in_progress || rcd.transfer_polled )
+	{
+		// completed, or the polling loop takes care of it
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+		return HRTIMER_NORESTART;
+	}
+	port = rcd.transfer_port;
+	q = &port->queues[rcd.transfer_class];
+	cs = rpc_spi_read_reg( BCM2835_SPI_CS );
+	done = cs & BCM2835_SPI_CS_DONE;
+	trace_rpc_spi_stall( port->index, rcd.transfer_class,
+			q->transfers[q->head & rcd.transfer_mask].send_data, cs, done );
+	if( done )
+	{
+		rcd.spi_lost_irqs++;
+	}
+	else
+	{
+		// the transfer stays at the head of its ring and starts again
+		rcd.spi_stall_resets++;
+		rpc_spi_reset();
+		rcd.transfer_in_progress = false;
+	}
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	LOG_ERR( "spi watchdog: %s (CS %08X)",
+			done ? "interrupt lost" : "transfer stalled, restarting it", cs );
+	if( done )
+	{
+		rpc_spi_complete_transfer();
+	}
+	rpc_spi_start_transfer( true );
+	if( rpc_spi_done_pending() )
+	{
+		irq_wake_thread( rcd.spi_irq, rcd.spi_irq_dev );
+	}
+	return HRTIMER_NORESTART;
+}
+
+/* SPI interrupt function called when a transfer is complete.
+ */
+static irqreturn_t rpc_spi_interrupt( int irq, void *dev_id )
+{
+	rpc_spi_complete_transfer();
+	// udelay( 1 );
+	rpc_spi_start_transfer( true );
+	if( rpc_spi_done_pending() )
+	{
+		return IRQ_WAKE_THREAD;
+	}
+	return IRQ_HANDLED;
+}
+
+/* SPI interrupt thread in threaded mode, calls the callbacks of the
+ * completed transfers in the order they completed.
+ */
+static irqreturn_t rpc_spi_irq_thread( int irq, void *dev_id )
+{
+	unsigned long spinlock_flags;
+	rpc_spi_done_t d;
+
+	rpc_irq_thread_prio( &rcd.spi_thread_prio );
+	rpc_irq_thread_cpu( &rcd.spi_thread_cpu );
+	for( ;; )
+	{
+		raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+		if( rcd.done_head == rcd.done_tail )
+		{
+			raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+			break;
+		}
+		d = rcd.done[rcd.done_head & (RPC_SPI_DONE_SIZE - 1)];
+		rcd.done_head++;
+		if( d.cpu != raw_smp_processor_id() )
+		{
+			rcd.callback_cross_cpu++;
+		}
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+		rpc_spi_run_callback( d.port, &d.t, d.failed );
+	}
+	// the ring may have been full, and the callbacks have queued more
+	rpc_spi_start_transfer( true );
+	return IRQ_HANDLED;
+}
+
+/* Add a transfer to the tail of the ring of a class, spi_lock must be held.
+ * Returns false if the ring is full.
+ */
+static bool rpc_spi_enqueue( RaspiCommPort_t* port, rpc_spi_class_t cls,
+				uint16_t send_data, bool current_config,
+				rpc_spi_callback_t callback )
+{
+	rpc_spi_queue_t* q = &port->queues[cls];
+	rpc_spi_transfer_t* t;
+	unsigned int count = rpc_spi_transfer_count( port, cls );
+
+	if( count > rcd.transfer_mask )
+	{
+		return false;
+	}
+	t = &q->transfers[q->tail & rcd.transfer_mask];
+	t->send_data = send_data;
+	t->recv_data = 0;
+	t->current_config = current_config;
+	t->burst = 0;
+	t->retries = 0;
+	t->queued = ktime_get();
+	t->callback = callback;
+	q->tail++;
+	trace_rpc_spi_submit( port->index, cls, send_data, count + 1 );
+	if( count >= q->high_water )
+	{
+		q->high_water = count + 1;
+	}
+	return true;
+}
+
+/* Class of a deferred transfer.
+ */
+static rpc_spi_class_t rpc_spi_defer_class( unsigned int what )
+{
+	switch( what )
+	{
+		case RPC_DEFER_RECEIVE_MODE:
+			return RPC_SPI_CLASS_TURN;
+		case RPC_DEFER_READ_DATA:
+			return RPC_SPI_CLASS_RX;
+		case RPC_DEFER_WRITE_CONFIG:
+			return RPC_SPI_CLASS_CFG;
+		default:
+			return RPC_SPI_CLASS_TX;
+	}
+}
+
+/* Queue a burst of RdDat commands, spi_lock must be held. If a burst is
+ * still running it reads again when it ends.
+ * Returns false if not even one read fits into the ring.
+ */
+static bool rpc_spi_queue_rx_burst( RaspiCommPort_t* port )
+{
+	rpc_spi_queue_t* q = &port->queues[RPC_SPI_CLASS_RX];
+	unsigned int size;
+	unsigned int n;
+
+	if( port->RxBurstLeft > 0 )
+	{
+		port->RxBurstRearm = true;
+		return true;
+	}
+	size = clamp_t( unsigned int, rx_burst_max, 1, 8 );
+	size = clamp_t( unsigned int, port->RxBurstSize, 1, size );
+	if( ++port->RxBurstId == 0 )
+	{
+		port->RxBurstId = 1;
+	}
+	for( n = 0; n < size; n++ )
+	{
+		if( !rpc_spi_enqueue( port, RPC_SPI_CLASS_RX, MAX3140_CMD_READ_DATA,
+						false, irq_msg_burst_read_done ) )
+		{
+			break;
+		}
+		q->transfers[(q->tail - 1) & rcd.transfer_mask].burst = port->RxBurstId;
+	}
+	if( n > 0 )
+	{
+		port->RxBurstLeft = n;
+		port->RxBurstReceived = 0;
+		port->RxBursts++;
+	}
+	return n > 0;
+}
+
+/* Queue as many deferred transfers of a port as there is room for, spi_lock
+ * must be held. A transfer which does not fit blocks the following ones of
+ * its class to keep the order.
+ */
+static void rpc_spi_queue_deferred( RaspiCommPort_t* port )
+{
+	unsigned int pending = port->transfer_deferred;
+	unsigned int blocked = 0;
+
+	while( pending )
+	{
+		unsigned int what = pending & -pending;
+		rpc_spi_class_t cls = rpc_spi_defer_class( what );
+		bool queued;
+
+		pending &= ~what;
+		if( blocked & (1 << cls) )
+		{
+			continue;
+		}
+		switch( what )
+		{
+			case RPC_DEFER_TX_CONFIG:
+			case RPC_DEFER_WRITE_CONFIG:
+				queued = rpc_spi_enqueue( port, cls, 0, true,
+								configure_uart_done );
+				break;
+			case RPC_DEFER_TRANSMIT_MODE:
+				queued = rpc_spi_enqueue( port, cls, MAX3140_CMD_TRANSMIT_MODE,
+								false, start_transmitting_done2 );
+				break;
+			case RPC_DEFER_RECEIVE_MODE:
+				queued = rpc_spi_enqueue( port, cls, MAX3140_CMD_RECEIVE_MODE,
+								false, stop_transmitting_done );
+				break;
+			case RPC_DEFER_READ_DATA:
+				queued = rpc_spi_queue_rx_burst( port );
+				break;
+			case RPC_DEFER_TX_KICK:
+			default:
+				queued = rpc_spi_enqueue( port, cls, MAX3140_CMD_READ_DATA,
+								false, irq_msg_read_done );
+				break;
+		}
+		if( queued )
+		{
+			port->transfer_deferred &= ~what;
+		}
+		else
+		{
+			blocked |= 1 << cls;
+		}
+	}
+}
+
+/* Returns true if a deferred transfer of the class is waiting.
+ */
+static bool rpc_spi_class_deferred( RaspiCommPort_t* port, rpc_spi_class_t cls )
+{
+	unsigned int pending = port->transfer_deferred;
+
+	while( pending )
+	{
+		unsigned int what = pending & -pending;
+		if( rpc_spi_defer_class( what ) == cls )
+		{
+			return true;
+		}
+		pending &= ~what;
+	}
+	return false;
+}
+
+/* Queue a transfer. Returns false if the ring is full, the caller has to
+ * keep the data and try again later. Deferred transfers of the same class
+ * go first so the order of the commands is kept.
+ */
+bool rpc_spi_transfer_word( RaspiCommPort_t* port, rpc_spi_class_t cls,
+				uint16_t send_data, rpc_spi_callback_t callback )
+{
+	unsigned long spinlock_flags;
+	bool rc;
+
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	rpc_spi_queue_deferred( port );
+	rc = !rpc_spi_class_deferred( port, cls ) &&
+			rpc_spi_enqueue( port, cls, send_data, false, callback );
+	if( !rc )
+	{
+		port->queues[cls].rejected++;
+	}
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	// most callers hold dev_lock, the interrupt completes it
+	rpc_spi_start_transfer( false );
+	return rc;
+}
+
+/* Queue one of the RPC_DEFER_xxx transfers. If the ring is full it is
+ * remembered and queued as soon as a transfer has completed. Requesting the
+ * same transfer again while it is still deferred queues it only once.
+ * may_poll is passed to rpc_spi_start_transfer().
+ */
+static void rpc_spi_defer_transfer( RaspiCommPort_t* port,
+				rpc_spi_defer_t what, bool may_poll )
+{
+	unsigned long spinlock_flags;
+
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	if( !(port->transfer_deferred & what) )
+	{
+		port->transfer_deferred |= what;
+		rpc_spi_queue_deferred( port );
+		if( port->transfer_deferred & what )
+		{
+			port->queues[rpc_spi_defer_class( what )].deferred++;
+		}
+	}
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	rpc_spi_start_transfer( may_poll );
+}
+
+/* Queue one of the RPC_DEFER_xxx transfers, most callers hold dev_lock so
+ * the interrupt completes it.
+ */
+static void rpc_spi_transfer_deferrable( RaspiCommPort_t* port,
+				rpc_spi_defer_t what )
+{
+	rpc_spi_defer_transfer( port, what, false );
+}
+
+/* The same for callers which hold no dev_lock, a short transfer is polled
+ * and its callback called from here.
+ */
+static void rpc_spi_transfer_deferrable_unlocked( RaspiCommPort_t* port,
+				rpc_spi_defer_t what )
+{
+	rpc_spi_defer_transfer( port, what, true );
+}
+
+/* Divider of the core clock for an SCLK of at most hz. The BCM2835 needs an
+ * even divider, 0 is the slowest one and divides by 65536.
+ */
+static unsigned int rpc_spi_cdiv( unsigned long core_hz, unsigned int hz )
+{
+	unsigned long cdiv;
+
+	if( hz >= core_hz / 2 )
+	{
+		return 2;
+	}
+	cdiv = DIV_ROUND_UP( core_hz, hz );
+	cdiv += cdiv & 1;
+	return cdiv < 65536 ? cdiv : 0;
+}
+
+/* SCLK resulting from a divider.
+ */
+static unsigned long rpc_spi_cdiv_hz( unsigned long core_hz, unsigned int cdiv )
+{
+	return core_hz / (cdiv ? cdiv : 65536);
+}
+
+/* Calculate the divider and the time of a transfer for the current core
+ * clock, spi_lock must be held. The divider is written before the next
+ * transfer is started.
+ */
+static void rpc_spi_update_clock_locked(void)
+{
+	unsigned long hz;
+
+	rcd.spi_cdiv = rpc_spi_cdiv( rcd.core_hz, rcd.spi_target_hz );
+	rcd.spi_cdiv_dirty = true;
+	trace_rpc_spi_clock( rcd.spi_target_hz, rcd.core_hz, rcd.spi_cdiv );
+	hz = rpc_spi_cdiv_hz( rcd.core_hz, rcd.spi_cdiv );
+	// the time of one 16 bit transfer decides whether it is polled
+	rcd.spi_word_ns = div_u64( (u64)16 * NSEC_PER_SEC + hz - 1, hz );
+}
+
+/* Set the target SPI clock, it is limited to what the MAX3140 can do.
+ */
+static void rpc_spi_set_speed( unsigned int hz )
+{
+	unsigned long spinlock_flags;
+
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	rcd.spi_target_hz = clamp_t( unsigned int, hz, 1, MAX3140_SCLK_MAX_HZ );
+	rcd.spi_nominal_hz = rcd.spi_target_hz;
+	rpc_spi_update_clock_locked();
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	LOG_DBG( "spi clock %lu Hz (core %lu Hz / %u), word time %u ns",
+			rpc_spi_cdiv_hz( rcd.core_hz, rcd.spi_cdiv ), rcd.core_hz,
+			rcd.spi_cdiv, rcd.spi_word_ns );
+}
+
+/* The core clock changes with the CPU frequency on some boards. Before it
+ * gets faster the divider for the new rate is set already, so SCLK never
+ * exceeds the target.
+ */
+static int rpc_spi_clk_notify( struct notifier_block* nb,
+				unsigned long event, void* data )
+{
+	struct clk_notifier_data* cnd = data;
+	unsigned long spinlock_flags;
+	unsigned long rate;
+
+	switch( event )
+	{
+		case PRE_RATE_CHANGE:
+			if( cnd->new_rate <= cnd->old_rate )
+			{
+				return NOTIFY_OK;
+			}
+			rate = cnd->new_rate;
+			break;
+		case POST_RATE_CHANGE:
+			rate = cnd->new_rate;
+			break;
+		case ABORT_RATE_CHANGE:
+			rate = cnd->old_rate;
+			break;
+		default:
+			return NOTIFY_DONE;
+	}
+	if( rate == 0 )
+	{
+		return NOTIFY_OK;
+	}
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	rcd.core_hz = rate;
+	rpc_spi_update_clock_locked();
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	LOG( "core clock %lu Hz, spi divider %u", rate, rcd.spi_cdiv );
+	return NOTIFY_OK;
+}
+
+int rpc_spi_bcm2835_init( struct platform_device* pdev )
+{
+	struct resource *res;
+	int err;
+
+	res = platform_get_resource( pdev, IORESOURCE_MEM, 0 );
+	rcd.regs = devm_ioremap_resource( &pdev->dev, res );
+	if( IS_ERR(rcd.regs) )
+	{
+		err = PTR_ERR( rcd.regs );
+		goto out_master_put;
+	}
+
+	rcd.clk = devm_clk_get( &pdev->dev, NULL );
+	if( IS_ERR(rcd.clk) )
+	{
+		err = PTR_ERR( rcd.clk );
+		dev_err( &pdev->dev, "could not get clk: %d\n", err );
+		goto out_master_put;
+	}
+
+	rcd.spi_irq = platform_get_irq( pdev, 0 );
+	if( rcd.spi_irq <= 0 )
+	{
+		dev_err( &pdev->dev, "could not get IRQ: %d\n", rcd.spi_irq );
+		err = rcd.spi_irq ? rcd.spi_irq : -ENODEV;
+		goto out_master_put;
+	}
+	LOG_DBG( "spi_irq = %d", rcd.spi_irq );
+
+	raw_spin_lock_init( &rcd.spi_lock );
+	hrtimer_init( &rcd.spi_watchdog, CLOCK_MONOTONIC, HRTIMER_MODE_ABS );
+	rcd.spi_watchdog.function = rpc_spi_watchdog_expired;
+	// the depth in use is shown in the spi_queue_depth attribute
+	rcd.transfer_mask = rounddown_pow_of_two( clamp_t( unsigned int,
+				spi_queue_depth, 2, SPI_MAX_TRANSFER_COUNT ) ) - 1;
+
+	clk_prepare_enable( rcd.clk );
+
+	rcd.threaded = irq_threaded;
+	rcd.spi_irq_dev = &pdev->dev;
+	rcd.spi_thread_cpu = -1;
+	rcd.irq_cpu = -1;
+	if( rcd.threaded )
+	{
+		// the transfers are completed and started in hard interrupt
+		// context on PREEMPT_RT as well, the callbacks run in the thread
+		err = devm_request_threaded_irq( &pdev->dev, rcd.spi_irq,
+					rpc_spi_interrupt, rpc_spi_irq_thread, IRQF_NO_THREAD,
+					dev_name(&pdev->dev), &pdev->dev );
+	}
+	else
+	{
+		err = devm_request_irq( &pdev->dev, rcd.spi_irq, rpc_spi_interrupt,
+					0, dev_name(&pdev->dev), &pdev->dev );
+	}
+	if( err )
+	{
+		dev_err( &pdev->dev, "could not request IRQ: %d\n", err );
+		goto out_clk_disable;
+	}
+
+	// the divider follows the core clock
+	rpc_spi_reset();
+	rcd.core_hz = clk_get_rate( rcd.clk );
+	if( rcd.core_hz == 0 )
+	{
+		rcd.core_hz = 250000000;
+	}
+	rpc_spi_set_speed( spi_speed_hz );
+	rpc_spi_write_reg( BCM2835_SPI_CLK, rcd.spi_cdiv );
+	rcd.clk_nb.notifier_call = rpc_spi_clk_notify;
+	if( clk_notifier_register( rcd.clk, &rcd.clk_nb ) )
+	{
+		LOG_ERR( "clk_notifier_register failed, the spi clock does not "
+				"follow the core clock" );
+	}
+	else
+	{
+		rcd.clk_nb_registered = true;
+	}
+
+	return 0;
+
+out_master_put:
+out_clk_disable:
+	clk_disable_unprepare( rcd.clk );
+// out_none:
+	return err;
+}
+
+void rpc_spi_bcm2835_exit( struct platform_device* pdev )
+{
+	hrtimer_cancel( &rcd.spi_watchdog );
+	irq_set_affinity_hint( rcd.spi_irq, NULL );
+	/* Clear FIFOs, and disable the HW block */
+	rpc_spi_write_reg( BCM2835_SPI_CS,
+			BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX );
+
+	// free_irq( rcd.spi_irq, NULL );
+	if( rcd.clk_nb_registered )
+	{
+		clk_notifier_unregister( rcd.clk, &rcd.clk_nb );
+	}
+	clk_disable_unprepare( rcd.clk );
+}
+
+// }}} SPI BCM2835 functions
+//============================================================================
+// {{{ SPI calibration
+
+// SPI clocks tried by the calibration
+static const unsigned int rpc_calib_speeds[RPC_CALIB_STEPS] = {
+	500000, 1000000, 2000000, 3000000, 4000000
+};
+
+// baud rates checked against the interrupt latency, from fast to slow
+static const unsigned int rpc_calib_bauds[] = {
+	230400, 115200, 57600, 38400, 19200, 9600
+};
+
+static void rpc_calib_done( RaspiCommPort_t* port,
+				uint16_t send_data, uint16_t recv_data )
+{
+	rcd.calib_rcvd = recv_data;
+	complete( &rcd.calib_done );
+}
+
+/* One RdCfg round trip through the scheduler. RdCfg has no side effects on
+ * the MAX3140, so it can run while the port is in use.
+ * Returns 0 if the config read back matches, 1 if not and a negative error
+ * if the transfer did not complete.
+ */
+static int rpc_calib_round( RaspiCommPort_t* port )
+{
+	int tries = 10;
+
+	reinit_completion( &rcd.calib_done );
+	while( !rpc_spi_transfer_word( port, RPC_SPI_CLASS_CFG,
+					MAX3140_CMD_READ_CONFIG, rpc_calib_done ) )
+	{
+		if( --tries == 0 )
+		{
+			return -EBUSY;
+		}
+		msleep( 1 );
+	}
+	if( !wait_for_completion_timeout( &rcd.calib_done,
+				msecs_to_jiffies( 100 ) ) )
+	{
+		return -ETIMEDOUT;
+	}
+	return (rcd.calib_rcvd & MAX3140_CONFIG_READBACK_MASK) !=
+			(READ_ONCE( port->UartConfig ) & MAX3140_CONFIG_READBACK_MASK);
+}
+
+/* Highest baud rate whose receive FIFO is emptied in time: the worst
+ * interrupt latency plus a burst reading all 8 words has to fit into the
+ * 7 characters which still fit into the FIFO after the one that raised
+ * the interrupt.
+ */
+static unsigned int rpc_calib_safe_baud( const rpc_calib_result_t* r )
+{
+	u64 service_ns = r->irq_max_ns + 8 * (u64)rcd.spi_word_ns;
+	unsigned int i;
+
+	for( i = 0; i < ARRAY_SIZE(rpc_calib_bauds); i++ )
+	{
+		// 7 characters of at least 10 bits
+		if( service_ns < div_u64( 70ULL * NSEC_PER_SEC, rpc_calib_bauds[i] ) )
+		{
+			return rpc_calib_bauds[i];
 		}
 	}
-	spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
-	return rc;
+	return 0;
 }
 
-/* SPI interrupt function called when a transfer is complete.
+/* Find the fastest reliable SPI clock. The clocks are tried from slow to
+ * fast with RdCfg round trips on all ports, the first one with a wrong
+ * read back, a FIFO error or a transfer which did not complete ends the
+ * search. The fastest good clock is kept, else the previous one.
+ * Returns 0 or a negative error.
  */
-static irqreturn_t rpc_spi_interrupt( int irq, void *dev_id )
+static int rpc_spi_calibrate(void)
 {
 	unsigned long spinlock_flags;
-	uint8_t h, l;
-	rpc_spi_transfer_t t;
-	bool more;
-	uint8_t read_err;
-
-	spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
-	t = rcd.transfers[0];
+	unsigned int old_hz = rcd.spi_target_hz;
+	unsigned int best = RPC_CALIB_STEPS;
+	unsigned long fifo_errors;
+	rpc_calib_result_t* r;
+	unsigned int step, round, i;
+	bool failed = false;
+	int rc;
 
-	read_err = 0;
-	h = l = 0;
-	if( !rpc_spi_read_fifo( &h ) )
-	{
-		read_err |= 0x10;
-	}
-	if( !rpc_spi_read_fifo( &l ) )
+	if( rcd.port_count == 0 )
 	{
-		read_err |= 0x01;
+		return -ENODEV;
 	}
-	t.recv_data = h<<8 | l;
-	rpc_spi_write_reg( BCM2835_SPI_CS, SPI_CS_DONE );
-	rcd.transfer_in_progress = false;
-	if( read_err == 0 )
+	mutex_lock( &rcd.calib_lock );
+	LOG_INFO( "spi calibration started" );
+	WRITE_ONCE( rcd.calibrating, true );
+	rcd.calib_steps = 0;
+	for( step = 0; step < RPC_CALIB_STEPS && !failed; step++ )
 	{
-		// SPI transfer finished
-		rcd.transfer_count--;
-		more = rcd.transfer_count;
-		if( more )
+		if( rpc_calib_speeds[step] > rcd.spi_max_hz )
 		{
-			// remove the transfer from the list by moving all others one down
-			memmove( rcd.transfers, rcd.transfers+1,
-					rcd.transfer_count*sizeof(*rcd.transfers) );
+			break;
 		}
-		spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
-#ifdef DEBUG
-		log_max3140_message( t.send_data, t.recv_data, 0 );
-#endif
-		if( t.callback )
+		r = &rcd.calib[rcd.calib_steps++];
+		memset( r, 0, sizeof(*r) );
+		r->target_hz = rpc_calib_speeds[step];
+		rpc_spi_set_speed( r->target_hz );
+
+		raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+		r->actual_hz = rpc_spi_cdiv_hz( rcd.core_hz, rcd.spi_cdiv );
+		fifo_errors = rcd.fifo_errors;
+		rcd.calib_cur = r;
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+
+		for( round = 0; round < RPC_CALIB_ROUNDS && !failed; round++ )
+		{
+			for( i = 0; i < rcd.port_count && !failed; i++ )
+			{
+				rc = rpc_calib_round( rcd.ports[i] );
+				if( rc < 0 )
+				{
+					r->timeouts++;
+					failed = true;
+				}
+				else
+				{
+					r->rounds++;
+					r->mismatches += rc;
+				}
+			}
+		}
+
+		raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+		rcd.calib_cur = NULL;
+		rcd.calib_t0 = 0;
+		r->fifo_errors = rcd.fifo_errors - fifo_errors;
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+
+		LOG_INFO( "spi calibration: %lu Hz rounds=%u mismatches=%u "
+				"timeouts=%u fifo_errors=%lu irq_max_us=%llu",
+				r->actual_hz, r->rounds, r->mismatches, r->timeouts,
+				r->fifo_errors, div_u64( r->irq_max_ns, NSEC_PER_USEC ) );
+		if( r->mismatches || r->fifo_errors )
 		{
-			t.callback( t.send_data, t.recv_data );
+			failed = true;
+		}
+		if( !failed )
+		{
+			best = rcd.calib_steps - 1;
 		}
-		// LOG( "MAX3140 IRQ %d", gpio_get_value( rcd.irqGPIO ) );
 	}
-	else
+	WRITE_ONCE( rcd.calibrating, false );
+
+	if( best < RPC_CALIB_STEPS )
 	{
-		// SPI transfer failed, try it again
-		spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
-		more = true;
-		LOG_ERR( "rpc_spi_interrupt: error reading FIFO (%02X)", read_err );
-		log_max3140_message( t.send_data, -1, 1 );
-		rpc_spi_write_reg( BCM2835_SPI_CS, SPI_CS_RESET );
+		rcd.calib_selected_hz = rcd.calib[best].target_hz;
 	}
-	if( more )
+	else
 	{
-		// udelay( 1 );
-		rpc_spi_start_transfer();
+		// not even the slowest clock works, keep what was set
+		rcd.calib_selected_hz = old_hz;
 	}
-	return IRQ_HANDLED;
+	rpc_spi_set_speed( rcd.calib_selected_hz );
+	rcd.calib_safe_baud = best < RPC_CALIB_STEPS ?
+			rpc_calib_safe_baud( &rcd.calib[best] ) : 0;
+	LOG_INFO( "spi calibration done, %u Hz selected, safe up to %u baud",
+			rcd.calib_selected_hz, rcd.calib_safe_baud );
+	mutex_unlock( &rcd.calib_lock );
+	return best < RPC_CALIB_STEPS ? 0 : -EIO;
+}
+
+// }}} SPI calibration
+//============================================================================
+// {{{ sysfs attributes
+
+static ssize_t spi_queue_depth_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	return sprintf( buf, "%u\n", rcd.transfer_mask + 1 );
+}
+static DEVICE_ATTR_RO( spi_queue_depth );
+
+static const char* const rpc_spi_class_names[RPC_SPI_CLASS_COUNT] = {
+	"turn", "rx", "tx", "cfg"
+};
+
+static ssize_t spi_queue_high_water_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+
+	return sprintf( buf, "turn=%u rx=%u tx=%u cfg=%u\n",
+			port->queues[RPC_SPI_CLASS_TURN].high_water,
+			port->queues[RPC_SPI_CLASS_RX].high_water,
+			port->queues[RPC_SPI_CLASS_TX].high_water,
+			port->queues[RPC_SPI_CLASS_CFG].high_water );
+}
+static DEVICE_ATTR_RO( spi_queue_high_water );
+
+static ssize_t spi_queue_rejected_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+
+	return sprintf( buf, "turn=%lu rx=%lu tx=%lu cfg=%lu\n",
+			port->queues[RPC_SPI_CLASS_TURN].rejected,
+			port->queues[RPC_SPI_CLASS_RX].rejected,
+			port->queues[RPC_SPI_CLASS_TX].rejected,
+			port->queues[RPC_SPI_CLASS_CFG].rejected );
+}
+static DEVICE_ATTR_RO( spi_queue_rejected );
+
+static ssize_t spi_queue_deferred_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+
+	return sprintf( buf, "turn=%lu rx=%lu tx=%lu cfg=%lu\n",
+			port->queues[RPC_SPI_CLASS_TURN].deferred,
+			port->queues[RPC_SPI_CLASS_RX].deferred,
+			port->queues[RPC_SPI_CLASS_TX].deferred,
+			port->queues[RPC_SPI_CLASS_CFG].deferred );
 }
+static DEVICE_ATTR_RO( spi_queue_deferred );
 
-bool rpc_spi_transfer_word( uint16_t send_data, rpc_spi_callback_t callback )
+// time from queueing a transfer of the port until it is started, per class
+static ssize_t spi_queue_wait_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
 {
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
 	unsigned long spinlock_flags;
+	ssize_t len = 0;
+	int cls;
 
-	if( rcd.transfer_count >= (SPI_MAX_TRANSFER_COUNT-1) )
+	for( cls = 0; cls < RPC_SPI_CLASS_COUNT; cls++ )
 	{
-		return false;
+		rpc_spi_queue_t* q = &port->queues[cls];
+		unsigned long started;
+		u64 total, max;
+
+		raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+		started = q->started;
+		total = q->wait_total_ns;
+		max = q->wait_max_ns;
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+		len += sprintf( buf + len, "%s: count=%lu avg_us=%llu max_us=%llu\n",
+				rpc_spi_class_names[cls], started,
+				started ? div_u64( total, started ) / NSEC_PER_USEC : 0,
+				div_u64( max, NSEC_PER_USEC ) );
 	}
-	spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
-	rcd.transfers[rcd.transfer_count].send_data = send_data;
-	rcd.transfers[rcd.transfer_count].recv_data = 0;
-	rcd.transfers[rcd.transfer_count].callback = callback;
-	rcd.transfer_count++;
-	spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
-	rpc_spi_start_transfer();
-	return true;
+	return len;
 }
 
-int rpc_spi_bcm2835_init( struct platform_device* pdev )
+// writing anything resets the wait statistics
+static ssize_t spi_queue_wait_store( struct device* dev,
+				struct device_attribute* attr, const char* buf, size_t count )
 {
-	struct resource *res;
-	int err;
-	int clk_value;
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+	unsigned long spinlock_flags;
+	int cls;
 
-	res = platform_get_resource( pdev, IORESOURCE_MEM, 0 );
-	rcd.regs = devm_ioremap_resource( &pdev->dev, res );
-	if( IS_ERR(rcd.regs) )
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	for( cls = 0; cls < RPC_SPI_CLASS_COUNT; cls++ )
 	{
-		err = PTR_ERR( rcd.regs );
-		goto out_master_put;
+		port->queues[cls].started = 0;
+		port->queues[cls].wait_total_ns = 0;
+		port->queues[cls].wait_max_ns = 0;
 	}
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	return count;
+}
+static DEVICE_ATTR_RW( spi_queue_wait );
 
-	rcd.clk = devm_clk_get( &pdev->dev, NULL );
-	if( IS_ERR(rcd.clk) )
+// number of transfers completed by polling and by the interrupt, and
+// recoveries of the watchdog
+static ssize_t spi_transfer_mode_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	return sprintf( buf, "polled=%lu irq=%lu poll_timeouts=%lu "
+			"lost_irqs=%lu stall_resets=%lu\n",
+			rcd.transfers_polled, rcd.transfers_irq, rcd.poll_timeouts,
+			rcd.spi_lost_irqs, rcd.spi_stall_resets );
+}
+static DEVICE_ATTR_RO( spi_transfer_mode );
+
+// SPI clock: requested and effective SCLK, core clock and divider
+static ssize_t spi_clock_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	unsigned long spinlock_flags;
+	unsigned long core_hz;
+	unsigned int target_hz, cdiv, word_ns;
+
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	core_hz = rcd.core_hz;
+	target_hz = rcd.spi_target_hz;
+	cdiv = rcd.spi_cdiv;
+	word_ns = rcd.spi_word_ns;
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	return sprintf( buf, "target_hz=%u actual_hz=%lu core_hz=%lu divider=%u "
+			"word_ns=%u\n",
+			target_hz, rpc_spi_cdiv_hz( core_hz, cdiv ), core_hz,
+			cdiv ? cdiv : 65536, word_ns );
+}
+static DEVICE_ATTR_RO( spi_clock );
+
+// FIFO error recovery: errors, clock changes and the controller state of
+// the last errors, oldest first
+static ssize_t spi_errors_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	unsigned long spinlock_flags;
+	rpc_spi_error_t errors[RPC_SPI_ERROR_SNAPSHOTS];
+	unsigned int head, count, i;
+	ssize_t len;
+
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	len = sprintf( buf, "fifo_errors=%lu downshifts=%lu upshifts=%lu "
+			"target_hz=%u nominal_hz=%u\n",
+			rcd.fifo_errors, rcd.spi_downshifts, rcd.spi_upshifts,
+			rcd.spi_target_hz, rcd.spi_nominal_hz );
+	memcpy( errors, rcd.spi_errors, sizeof(errors) );
+	head = rcd.spi_error_head;
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+
+	count = min_t( unsigned int, head, RPC_SPI_ERROR_SNAPSHOTS );
+	for( i = head - count; i != head; i++ )
 	{
-		err = PTR_ERR( rcd.clk );
-		dev_err( &pdev->dev, "could not get clk: %d\n", err );
-		goto out_master_put;
+		rpc_spi_error_t* e = &errors[i % RPC_SPI_ERROR_SNAPSHOTS];
+
+		len += sprintf( buf + len, "%lld ttyRPC%u sent=%04X err=%02X "
+				"cs=%08X cs_reset=%08X\n",
+				ktime_to_ns( e->time ), e->port, e->sent, e->read_err,
+				e->cs, e->cs_reset );
 	}
+	return len;
+}
+static DEVICE_ATTR_RO( spi_errors );
 
-	rcd.spi_irq = platform_get_irq( pdev, 0 );
-	if( rcd.spi_irq <= 0 )
+// results of the last calibration, one line per SPI clock tried
+static ssize_t spi_calibration_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	ssize_t len = 0;
+	unsigned int i;
+
+	mutex_lock( &rcd.calib_lock );
+	for( i = 0; i < rcd.calib_steps; i++ )
 	{
-		dev_err( &pdev->dev, "could not get IRQ: %d\n", rcd.spi_irq );
-		err = rcd.spi_irq ? rcd.spi_irq : -ENODEV;
-		goto out_master_put;
+		rpc_calib_result_t* r = &rcd.calib[i];
+
+		len += sprintf( buf + len, "hz=%u actual_hz=%lu rounds=%u "
+				"mismatches=%u timeouts=%u fifo_errors=%lu "
+				"irq_avg_us=%llu irq_max_us=%llu\n",
+				r->target_hz, r->actual_hz, r->rounds, r->mismatches,
+				r->timeouts, r->fifo_errors,
+				r->irq_count ? div_u64( r->irq_total_ns, r->irq_count ) /
+						NSEC_PER_USEC : 0,
+				div_u64( r->irq_max_ns, NSEC_PER_USEC ) );
 	}
-	LOG_DBG( "spi_irq = %d", rcd.spi_irq );
+	len += sprintf( buf + len, "selected_hz=%u safe_baud=%u\n",
+			rcd.calib_selected_hz, rcd.calib_safe_baud );
+	mutex_unlock( &rcd.calib_lock );
+	return len;
+}
+
+// writing anything runs the calibration
+static ssize_t spi_calibration_store( struct device* dev,
+				struct device_attribute* attr, const char* buf, size_t count )
+{
+	int err = rpc_spi_calibrate();
 
-	spin_lock_init( &rcd.spi_lock );
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW( spi_calibration );
 
-	clk_prepare_enable( rcd.clk );
+// CPU the interrupts are pinned to, how many of them could not be pinned
+// and the completions which moved between CPUs
+static ssize_t irq_cpu_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	unsigned long spinlock_flags;
+	unsigned long spi_cross, callback_cross, gpio_cross = 0;
+	unsigned int pin_errors = rcd.spi_irq_pin_err ? 1 : 0;
+	unsigned int i;
 
-	err = devm_request_irq( &pdev->dev, rcd.spi_irq, rpc_spi_interrupt,
-					0, dev_name(&pdev->dev), &pdev->dev );
+	for( i = 0; i < rcd.port_count; i++ )
+	{
+		gpio_cross += rcd.ports[i]->GpioCrossCpu;
+		pin_errors += rcd.ports[i]->IrqPinErr ? 1 : 0;
+	}
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	spi_cross = rcd.spi_cross_cpu;
+	callback_cross = rcd.callback_cross_cpu;
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	return sprintf( buf, "cpu=%d exclusive=%d pin_errors=%u "
+			"spi_cross_cpu=%lu callback_cross_cpu=%lu gpio_cross_cpu=%lu\n",
+			READ_ONCE( rcd.irq_cpu ), READ_ONCE( irq_cpu_exclusive ),
+			pin_errors, spi_cross, callback_cross, gpio_cross );
+}
+
+static ssize_t irq_cpu_store( struct device* dev,
+				struct device_attribute* attr, const char* buf, size_t count )
+{
+	int cpu;
+	int err;
+
+	err = kstrtoint( buf, 0, &cpu );
 	if( err )
 	{
-		dev_err( &pdev->dev, "could not request IRQ: %d\n", err );
-		goto out_clk_disable;
+		return err;
+	}
+	err = rpc_irq_set_cpu( cpu );
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW( irq_cpu );
+
+// throughput and SPI latency of each port, shows whether one port
+// starves the others
+static ssize_t ports_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	unsigned long spinlock_flags;
+	ssize_t len = 0;
+	unsigned int i;
+	int cls;
+
+	for( i = 0; i < rcd.port_count; i++ )
+	{
+		RaspiCommPort_t* port = rcd.ports[i];
+		unsigned long transfers, started = 0;
+		u64 total = 0, max = 0;
+
+		raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+		transfers = port->SpiTransfers;
+		for( cls = 0; cls < RPC_SPI_CLASS_COUNT; cls++ )
+		{
+			started += port->queues[cls].started;
+			total += port->queues[cls].wait_total_ns;
+			max = max( max, port->queues[cls].wait_max_ns );
+		}
+		raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+		len += sprintf( buf + len, "ttyRPC%u: cs=%u gpio=%d rx_bytes=%lu "
+				"tx_bytes=%lu transfers=%lu wait_avg_us=%llu wait_max_us=%llu\n",
+				i, port->cs, port->irqGPIO, port->RxBytes, port->TxBytes,
+				transfers, started ? div_u64( total, started ) / NSEC_PER_USEC : 0,
+				div_u64( max, NSEC_PER_USEC ) );
 	}
+	return len;
+}
+static DEVICE_ATTR_RO( ports );
 
-	// 1MHz SPI clock, should be calculated ++++++
-	clk_value = 250;
-	// clk_value = 250 * 250;
-	rpc_spi_reset();
-	rpc_spi_write_reg( BCM2835_SPI_CLK, clk_value );
+// RX burst reads: size of the next burst, number of bursts, reads and
+// bytes received by them
+static ssize_t rx_burst_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+
+	return sprintf( buf, "size=%u bursts=%lu reads=%lu bytes=%lu\n",
+			port->RxBurstSize, port->RxBursts, port->RxBurstReads,
+			port->RxBurstBytes );
+}
+static DEVICE_ATTR_RO( rx_burst );
+
+// RX mode: current mode, switches between the modes, polls and the
+// bytes received in each mode
+static ssize_t rx_mode_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
 
+	return sprintf( buf, "mode=%s entries=%lu exits=%lu polls=%lu "
+			"bytes_irq=%lu bytes_polled=%lu\n",
+			port->RxPolling ? "polled" : "irq",
+			port->RxPollEntries, port->RxPollExits, port->RxPolls,
+			port->RxBytesIrq, port->RxBytesPolled );
+}
+static DEVICE_ATTR_RO( rx_mode );
+
+// bytes taken from WrDat responses and WrCfg/RdCfg responses with R set
+static ssize_t rx_harvested_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+
+	return sprintf( buf, "write_data=%lu config_pending=%lu\n",
+			port->RxFromWrite, port->RxPendingAfterConfig );
+}
+static DEVICE_ATTR_RO( rx_harvested );
+
+// TX: bytes sent, bytes chained off the previous WrDat response, SPI
+// transfers used for transmitting and transfers per byte
+static ssize_t tx_chain_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+	unsigned long bytes = port->TxBytes;
+	unsigned long transfers = port->TxSpiTransfers;
+	unsigned long per_byte = bytes ? (transfers * 100) / bytes : 0;
+
+	return sprintf( buf, "bytes=%lu chained=%lu transfers=%lu "
+			"per_byte=%lu.%02lu\n",
+			bytes, port->TxChained, transfers, per_byte / 100, per_byte % 100 );
+}
+static DEVICE_ATTR_RO( tx_chain );
+
+// number of pushes to the tty flip buffer and bytes pushed
+static ssize_t rx_batch_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+
+	return sprintf( buf, "pushes=%lu bytes=%lu\n",
+			port->RxPushes, port->RxPushedBytes );
+}
+static DEVICE_ATTR_RO( rx_batch );
+
+// RS485 turnaround: number of frames and the time from the end of the last
+// byte until receive mode was on the bus
+static ssize_t rs485_turnaround_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+	unsigned long spinlock_flags;
+	unsigned long frames;
+	u64 last, total, max;
+
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	frames = port->Rs485Frames;
+	last = port->Rs485TurnLastNs;
+	total = port->Rs485TurnTotalNs;
+	max = port->Rs485TurnMaxNs;
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	return sprintf( buf, "frames=%lu last_us=%llu avg_us=%llu max_us=%llu\n",
+			frames, div_u64( last, NSEC_PER_USEC ),
+			frames ? div_u64( total, frames ) / NSEC_PER_USEC : 0,
+			div_u64( max, NSEC_PER_USEC ) );
+}
+
+// writing anything resets the turnaround statistics
+static ssize_t rs485_turnaround_store( struct device* dev,
+				struct device_attribute* attr, const char* buf, size_t count )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+	unsigned long spinlock_flags;
+
+	spin_lock_irqsave( &port->dev_lock, spinlock_flags );
+	port->Rs485Frames = 0;
+	port->Rs485TurnLastNs = 0;
+	port->Rs485TurnTotalNs = 0;
+	port->Rs485TurnMaxNs = 0;
+	spin_unlock_irqrestore( &port->dev_lock, spinlock_flags );
+	return count;
+}
+static DEVICE_ATTR_RW( rs485_turnaround );
+
+// flow control: current state and number of state changes, bytes held
+// for a throttled tty and bytes lost because the hold ring was full, bytes
+// in the transmit queue and its effective size
+static ssize_t flow_control_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+
+	return sprintf( buf, "throttled=%d throttles=%lu held=%d overruns=%lu "
+			"stopped=%d stops=%lu tx_queued=%d tx_queue_size=%u\n",
+			port->RxThrottled, port->RxThrottles,
+			port->RxHold.arr ? queue_get_count( &port->RxHold ) : 0,
+			port->RxOverruns, port->TxStopped, port->TxStops,
+			port->TxQueue.arr ? queue_get_count( &port->TxQueue ) : 0,
+			port->TxQueue.size );
+}
+static DEVICE_ATTR_RO( flow_control );
+
+// counters of the port in one line, SPI transfers per byte received or sent
+static ssize_t counters_show( struct device* dev,
+				struct device_attribute* attr, char* buf )
+{
+	RaspiCommPort_t* port = dev_get_drvdata( dev );
+	rpc_port_counters_t c;
+	unsigned long bytes, per_byte;
+
+	rpc_port_get_counters( port, &c );
+	bytes = c.rx + c.tx;
+	per_byte = bytes ? (c.spi_transfers * 100) / bytes : 0;
+	return sprintf( buf, "rx=%lu tx=%lu frame=%lu parity=%lu overrun=%lu "
+			"spi_transfers=%lu spi_irqs=%lu spi_fifo_errors=%lu "
+			"spi_retries=%lu spi_give_ups=%lu resyncs=%lu "
+			"resync_mismatches=%lu rejected=%lu high_water=%u gpio_irqs=%lu "
+			"per_byte=%lu.%02lu\n",
+			c.rx, c.tx, c.frame, c.parity, c.overrun, c.spi_transfers,
+			c.spi_irqs, c.spi_fifo_errors, c.spi_retries, c.spi_give_ups,
+			c.resyncs, c.resync_mismatches, c.rejected, c.high_water,
+			c.gpio_irqs, per_byte / 100, per_byte % 100 );
+}
+static DEVICE_ATTR_RO( counters );
+
+static struct attribute* rpc_sysfs_attrs[] = {
+	&dev_attr_spi_queue_depth.attr,
+	&dev_attr_spi_transfer_mode.attr,
+	&dev_attr_spi_clock.attr,
+	&dev_attr_spi_errors.attr,
+	&dev_attr_spi_calibration.attr,
+	&dev_attr_irq_cpu.attr,
+	&dev_attr_ports.attr,
+	NULL
+};
+
+// the attributes show up in /sys/devices/platform/soc/<spi>/raspicomm/
+static const struct attribute_group rpc_sysfs_group = {
+	.name	= "raspicomm",
+	.attrs	= rpc_sysfs_attrs,
+};
+
+static struct attribute* rpc_port_attrs[] = {
+	&dev_attr_spi_queue_high_water.attr,
+	&dev_attr_spi_queue_rejected.attr,
+	&dev_attr_spi_queue_deferred.attr,
+	&dev_attr_spi_queue_wait.attr,
+	&dev_attr_rx_burst.attr,
+	&dev_attr_rx_mode.attr,
+	&dev_attr_rx_harvested.attr,
+	&dev_attr_tx_chain.attr,
+	&dev_attr_rx_batch.attr,
+	&dev_attr_rs485_turnaround.attr,
+	&dev_attr_flow_control.attr,
+	&dev_attr_counters.attr,
+	NULL
+};
+
+// the attributes of each port show up in /sys/class/tty/ttyRPC<n>/raspicomm/
+static const struct attribute_group rpc_port_group = {
+	.name	= "raspicomm",
+	.attrs	= rpc_port_attrs,
+};
+
+static const struct attribute_group* rpc_port_groups[2] = {
+	&rpc_port_group,
+	NULL
+};
+
+// }}} sysfs attributes
+//============================================================================
+// {{{ debugfs
+
+// the counters of a port, one per line for scripts
+static int rpc_debugfs_counters_show( struct seq_file* s, void* unused )
+{
+	RaspiCommPort_t* port = s->private;
+	rpc_port_counters_t c;
+
+	rpc_port_get_counters( port, &c );
+	seq_printf( s, "rx_bytes %lu\n", c.rx );
+	seq_printf( s, "tx_bytes %lu\n", c.tx );
+	seq_printf( s, "frame_errors %lu\n", c.frame );
+	seq_printf( s, "parity_errors %lu\n", c.parity );
+	seq_printf( s, "overruns %lu\n", c.overrun );
+	seq_printf( s, "spi_transfers %lu\n", c.spi_transfers );
+	seq_printf( s, "spi_irqs %lu\n", c.spi_irqs );
+	seq_printf( s, "spi_fifo_errors %lu\n", c.spi_fifo_errors );
+	seq_printf( s, "spi_retries %lu\n", c.spi_retries );
+	seq_printf( s, "spi_give_ups %lu\n", c.spi_give_ups );
+	seq_printf( s, "resyncs %lu\n", c.resyncs );
+	seq_printf( s, "resync_mismatches %lu\n", c.resync_mismatches );
+	seq_printf( s, "spi_rejected %lu\n", c.rejected );
+	seq_printf( s, "spi_high_water %u\n", c.high_water );
+	seq_printf( s, "gpio_irqs %lu\n", c.gpio_irqs );
 	return 0;
+}
 
-out_master_put:
-out_clk_disable:
-	clk_disable_unprepare( rcd.clk );
-// out_none:
-	return err;
+static int rpc_debugfs_counters_open( struct inode* inode, struct file* file )
+{
+	return single_open( file, rpc_debugfs_counters_show, inode->i_private );
 }
 
-void rpc_spi_bcm2835_exit( struct platform_device* pdev )
+static const struct file_operations rpc_debugfs_counters_fops = {
+	.owner		= THIS_MODULE,
+	.open		= rpc_debugfs_counters_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+// latency histograms of a port, the non-empty buckets of each stage
+static int rpc_debugfs_latency_show( struct seq_file* s, void* unused )
 {
-	/* Clear FIFOs, and disable the HW block */
-	rpc_spi_write_reg( BCM2835_SPI_CS,
-			BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX );
+	RaspiCommPort_t* port = s->private;
+	unsigned long spinlock_flags;
+	rpc_lat_hist_t h;
+	int stage, i;
 
-	// free_irq( rcd.spi_irq, NULL );
-	clk_disable_unprepare( rcd.clk );
+	for( stage = 0; stage < RPC_LAT_COUNT; stage++ )
+	{
+		raw_spin_lock_irqsave( &port->lat_lock, spinlock_flags );
+		h = port->LatHist[stage];
+		raw_spin_unlock_irqrestore( &port->lat_lock, spinlock_flags );
+		seq_printf( s, "%s count=%lu avg_us=%llu max_us=%llu\n",
+				rpc_lat_names[stage], h.count,
+				h.count ? div_u64( h.total_ns, h.count ) / NSEC_PER_USEC : 0,
+				div_u64( h.max_ns, NSEC_PER_USEC ) );
+		for( i = 0; i < RPC_LAT_BUCKETS; i++ )
+		{
+			if( h.buckets[i] == 0 )
+			{
+				continue;
+			}
+			if( i == 0 )
+			{
+				seq_printf( s, "  0 - 1 us: %lu\n", h.buckets[i] );
+			}
+			else if( i == RPC_LAT_BUCKETS - 1 )
+			{
+				seq_printf( s, "  %lu - ... us: %lu\n", 1UL << (i - 1),
+						h.buckets[i] );
+			}
+			else
+			{
+				seq_printf( s, "  %lu - %lu us: %lu\n", 1UL << (i - 1),
+						1UL << i, h.buckets[i] );
+			}
+		}
+	}
+	return 0;
 }
 
-// }}} SPI BCM2835 functions
+static int rpc_debugfs_latency_open( struct inode* inode, struct file* file )
+{
+	return single_open( file, rpc_debugfs_latency_show, inode->i_private );
+}
+
+// writing anything resets the histograms
+static ssize_t rpc_debugfs_latency_write( struct file* file,
+				const char __user* buf, size_t count, loff_t* ppos )
+{
+	RaspiCommPort_t* port = ((struct seq_file*)file->private_data)->private;
+	unsigned long spinlock_flags;
+
+	raw_spin_lock_irqsave( &port->lat_lock, spinlock_flags );
+	memset( port->LatHist, 0, sizeof(port->LatHist) );
+	raw_spin_unlock_irqrestore( &port->lat_lock, spinlock_flags );
+	return count;
+}
+
+static const struct file_operations rpc_debugfs_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= rpc_debugfs_latency_open,
+	.read		= seq_read,
+	.write		= rpc_debugfs_latency_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+// flight recorder from the oldest to the newest record
+static int rpc_debugfs_recorder_show( struct seq_file* s, void* unused )
+{
+	unsigned long spinlock_flags;
+	rpc_rec_t* recs;
+	unsigned int head, count, i;
+	bool frozen;
+
+	recs = kmalloc( sizeof(rcd.rec), GFP_KERNEL );
+	if( !recs )
+	{
+		return -ENOMEM;
+	}
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	memcpy( recs, rcd.rec, sizeof(rcd.rec) );
+	head = rcd.rec_head;
+	frozen = rcd.rec_frozen;
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+
+	count = min_t( unsigned int, head, RPC_REC_SIZE );
+	seq_printf( s, "%s records=%u\n", frozen ? "frozen" : "recording", count );
+	for( i = head - count; i != head; i++ )
+	{
+		rpc_rec_t* r = &recs[i & (RPC_REC_SIZE - 1)];
+		u32 rem;
+		u64 sec = div_u64_rem( r->ns, NSEC_PER_SEC, &rem );
+
+		seq_printf( s, "%llu.%09u ttyRPC%u cls=%u %04X -> %04X cs=%08X "
+				"depth=%u%s%s%s\n",
+				sec, rem,
+				r->port, r->cls, r->sent, r->rcvd, r->cs, r->depth,
+				r->flags & RPC_REC_ERROR ? " error" : "",
+				r->flags & RPC_REC_RETRY ? " retry" : "",
+				r->flags & RPC_REC_POLLED ? " polled" : "" );
+	}
+	kfree( recs );
+	return 0;
+}
+
+static int rpc_debugfs_recorder_open( struct inode* inode, struct file* file )
+{
+	return single_open( file, rpc_debugfs_recorder_show, inode->i_private );
+}
+
+// writing anything clears the recorder and starts recording again
+static ssize_t rpc_debugfs_recorder_write( struct file* file,
+				const char __user* buf, size_t count, loff_t* ppos )
+{
+	unsigned long spinlock_flags;
+
+	raw_spin_lock_irqsave( &rcd.spi_lock, spinlock_flags );
+	memset( rcd.rec, 0, sizeof(rcd.rec) );
+	rcd.rec_head = 0;
+	rcd.rec_stopping = false;
+	rcd.rec_frozen = false;
+	raw_spin_unlock_irqrestore( &rcd.spi_lock, spinlock_flags );
+	return count;
+}
+
+static const struct file_operations rpc_debugfs_recorder_fops = {
+	.owner		= THIS_MODULE,
+	.open		= rpc_debugfs_recorder_open,
+	.read		= seq_read,
+	.write		= rpc_debugfs_recorder_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* Create debugfs/raspicomm/ with a directory for each port. debugfs is
+ * optional, errors are ignored.
+ */
+static void rpc_debugfs_init(void)
+{
+	unsigned int i;
+	char name[16];
+
+	rcd.debugfs = debugfs_create_dir( "raspicomm", NULL );
+	if( IS_ERR_OR_NULL( rcd.debugfs ) )
+	{
+		rcd.debugfs = NULL;
+		return;
+	}
+	debugfs_create_file( "flight_recorder", 0644, rcd.debugfs, NULL,
+			&rpc_debugfs_recorder_fops );
+	// the raw ring, the newest record is before rec_head
+	rcd.rec_blob.data = rcd.rec;
+	rcd.rec_blob.size = sizeof(rcd.rec);
+	debugfs_create_blob( "flight_recorder.bin", 0444, rcd.debugfs,
+			&rcd.rec_blob );
+	debugfs_create_u32( "flight_recorder_head", 0444, rcd.debugfs,
+			&rcd.rec_head );
+	for( i = 0; i < rcd.port_count; i++ )
+	{
+		RaspiCommPort_t* port = rcd.ports[i];
+
+		snprintf( name, sizeof(name), "ttyRPC%u", i );
+		port->debugfs = debugfs_create_dir( name, rcd.debugfs );
+		debugfs_create_file( "counters", 0444, port->debugfs, port,
+				&rpc_debugfs_counters_fops );
+		debugfs_create_file( "latency", 0644, port->debugfs, port,
+				&rpc_debugfs_latency_fops );
+	}
+}
+
+static void rpc_debugfs_exit(void)
+{
+	unsigned int i;
+
+	debugfs_remove_recursive( rcd.debugfs );
+	rcd.debugfs = NULL;
+	for( i = 0; i < rcd.port_count; i++ )
+	{
+		rcd.ports[i]->debugfs = NULL;
+	}
+}
+
+// }}} debugfs
 //============================================================================
 // {{{ Platform Driver Code
 
@@ -1442,8 +5362,9 @@ static int raspicomm_probe( struct platform_device *pdev )
 	int err;
 
 	memset( &rcd, 0, sizeof(rcd) );
+	mutex_init( &rcd.calib_lock );
+	init_completion( &rcd.calib_done );
 
-	spin_lock_init( &rcd.dev_lock );
 	err = rpc_spi_bcm2835_init( pdev );
 	if( err )
 	{
@@ -1458,8 +5379,28 @@ static int raspicomm_probe( struct platform_device *pdev )
 		goto out_undo_spi_init;
 	}
 
+	if( irq_cpu >= 0 && rpc_irq_set_cpu( irq_cpu ) )
+	{
+		LOG_ERR( "irq_cpu %d is not an online cpu", irq_cpu );
+	}
+
+	if( spi_calibrate )
+	{
+		rpc_spi_calibrate();
+	}
+
+	err = sysfs_create_group( &pdev->dev.kobj, &rpc_sysfs_group );
+	if( err )
+	{
+		dev_err( &pdev->dev, "could not create sysfs group: %d\n", err );
+		goto out_undo_tty_init;
+	}
+	rpc_debugfs_init();
+
 	return 0;
 
+out_undo_tty_init:
+	rpc_tty_exit( pdev );
 out_undo_spi_init:
 	rpc_spi_bcm2835_exit( pdev );
 out_undo_none:
@@ -1468,6 +5409,8 @@ out_undo_none:
 
 static int raspicomm_remove( struct platform_device *pdev )
 {
+	rpc_debugfs_exit();
+	sysfs_remove_group( &pdev->dev.kobj, &rpc_sysfs_group );
 	rpc_tty_exit( pdev );
 	rpc_spi_bcm2835_exit( pdev );
 	return 0;
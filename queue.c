@@ -1,47 +1,151 @@
+
 #include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <asm/barrier.h>
 #include "module.h"
 #include "queue.h"
 
-int queue_get_room(queue_t* queue)
+/* The producer publishes new items with a release store of 'write' and the
+ * consumer frees them with a release store of 'read', each side reads the
+ * index of the other one with an acquire load. This orders the copy of the
+ * items against the index update without a lock. */
+
+int queue_init(queue_t* queue, unsigned int size)
 {
-  /* cache read / write for thread safety as they might be modified during the evaluation */
-  int read, write;
-  read = queue->read;
-  write = queue->write;
+  size = clamp_t(unsigned int, size, QUEUE_MIN_SIZE, QUEUE_MAX_SIZE);
+  size = rounddown_pow_of_two(size);
+  queue->arr = kvmalloc(size * sizeof(QUEUE_ITEM), GFP_KERNEL);
+  if (queue->arr == NULL) {
+    return -ENOMEM;
+  }
+  queue->size = size;
+  queue->read = 0;
+  queue->write = 0;
+  return 0;
+}
 
-  return (read > write) ? (read - write - 1) : (QUEUE_SIZE - 1 - write + read);
+void queue_free(queue_t* queue)
+{
+  kvfree(queue->arr);
+  queue->arr = NULL;
+  queue->size = 0;
+}
+
+int queue_get_count(queue_t* queue)
+{
+  /* both indices may be modified during the evaluation, the result is a
+   * snapshot which is exact for the producer and the consumer; a third
+   * party may see the indices from different moments, so keep it within
+   * [0, size] */
+  int count = (int)(smp_load_acquire(&queue->write) - smp_load_acquire(&queue->read));
+
+  return clamp(count, 0, (int)queue->size);
+}
+
+int queue_get_room(queue_t* queue)
+{
+  return queue->size - queue_get_count(queue);
 }
 
 int queue_is_full(queue_t* queue)
 {
-  return (((queue->write + 1) % QUEUE_SIZE) == queue->read);
+  return queue_get_room(queue) == 0;
 }
 
 int queue_is_empty(queue_t* queue)
 {
-  return (queue->write == queue->read);
+  return queue_get_count(queue) == 0;
+}
+
+/* producer side */
+unsigned int queue_enqueue_n(queue_t* queue, const QUEUE_ITEM* items, unsigned int n)
+{
+  unsigned int write = queue->write;
+  unsigned int room = queue->size - (write - smp_load_acquire(&queue->read));
+  unsigned int pos = write & (queue->size - 1);
+  unsigned int first;
+
+  n = min(n, room);
+  /* copy up to the end of the array, then the rest from the start */
+  first = min(n, queue->size - pos);
+  memcpy(&queue->arr[pos], items, first * sizeof(QUEUE_ITEM));
+  memcpy(&queue->arr[0], items + first, (n - first) * sizeof(QUEUE_ITEM));
+  smp_store_release(&queue->write, write + n);
+  return n;
+}
+
+/* producer side, adds map[bytes[i]] for each byte in one pass */
+unsigned int queue_enqueue_map(queue_t* queue, const uint8_t* bytes, unsigned int n, const QUEUE_ITEM* map)
+{
+  unsigned int write = queue->write;
+  unsigned int room = queue->size - (write - smp_load_acquire(&queue->read));
+  unsigned int mask = queue->size - 1;
+  unsigned int i;
+
+  n = min(n, room);
+  for (i = 0; i < n; i++) {
+    queue->arr[(write + i) & mask] = map[bytes[i]];
+  }
+  smp_store_release(&queue->write, write + n);
+  return n;
 }
 
 int queue_enqueue(queue_t* queue, QUEUE_ITEM item)
 {
-  if (queue_is_full(queue)) {
+  return queue_enqueue_n(queue, &item, 1);
+}
+
+/* consumer side */
+int queue_peek(queue_t* queue, QUEUE_ITEM* item)
+{
+  unsigned int read = queue->read;
+
+  if (smp_load_acquire(&queue->write) == read) {
     return 0;
   }
   else {
-    queue->arr[queue->write] = item;
-    queue->write = ((queue->write + 1) == QUEUE_SIZE) ? 0 : queue->write + 1;
+    *item = queue->arr[read & (queue->size - 1)];
     return 1;
   }
 }
 
+unsigned int queue_dequeue_n(queue_t* queue, QUEUE_ITEM* items, unsigned int n)
+{
+  unsigned int read = queue->read;
+  unsigned int count = smp_load_acquire(&queue->write) - read;
+  unsigned int pos = read & (queue->size - 1);
+  unsigned int first;
+
+  n = min(n, count);
+  first = min(n, queue->size - pos);
+  memcpy(items, &queue->arr[pos], first * sizeof(QUEUE_ITEM));
+  memcpy(items + first, &queue->arr[0], (n - first) * sizeof(QUEUE_ITEM));
+  smp_store_release(&queue->read, read + n);
+  return n;
+}
+
 int queue_dequeue(queue_t* queue, QUEUE_ITEM* item)
 {
-  if (queue_is_empty(queue)) {
-    return 0;
-  } 
-  else {
-    *item = queue->arr[queue->read];
-    queue->read = ((queue->read + 1) == QUEUE_SIZE) ? 0 : queue->read + 1;
-    return 1;
+  return queue_dequeue_n(queue, item, 1);
+}
+
+/* replaces each queued item by map[item & 0xFF], the producer must not run
+ * and the consumer must be locked out */
+void queue_remap(queue_t* queue, const QUEUE_ITEM* map)
+{
+  unsigned int mask = queue->size - 1;
+  unsigned int i;
+
+  for (i = queue->read; i != queue->write; i++) {
+    queue->arr[i & mask] = map[queue->arr[i & mask] & (QUEUE_MAP_SIZE - 1)];
   }
 }
+
+/* consumer side, drops everything the producer has published so far */
+void queue_clear(queue_t* queue)
+{
+  smp_store_release(&queue->read, smp_load_acquire(&queue->write));
+}
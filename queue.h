@@ -2,20 +2,37 @@
 #ifndef RASPICOMM_QUEUE_H
 #define RASPICOMM_QUEUE_H
 
-#define QUEUE_ITEM uint8_t
-#define QUEUE_SIZE 256
+/* the items are ready to send MAX3140 commands */
+#define QUEUE_ITEM uint16_t
+/* number of entries of a map, indexed by the lowest 8 bits of an item */
+#define QUEUE_MAP_SIZE 256
+/* limits of the queue size, it is rounded down to a power of two */
+#define QUEUE_MIN_SIZE 256
+#define QUEUE_MAX_SIZE 65536
 
+/* single producer / single consumer ring, read and write run freely and
+ * are masked on access, only the producer writes 'write' and only the
+ * consumer writes 'read' */
 typedef struct
 {
-  QUEUE_ITEM arr[QUEUE_SIZE];
-  int read, write;
+  QUEUE_ITEM* arr;
+  unsigned int size;
+  unsigned int read, write;
 } queue_t;
 
+int queue_init(queue_t* queue, unsigned int size);
+void queue_free(queue_t* queue);
 int queue_get_room(queue_t* queue);
+int queue_get_count(queue_t* queue);
 int queue_enqueue(queue_t* queue, QUEUE_ITEM item);
+unsigned int queue_enqueue_n(queue_t* queue, const QUEUE_ITEM* items, unsigned int n);
+unsigned int queue_enqueue_map(queue_t* queue, const uint8_t* bytes, unsigned int n, const QUEUE_ITEM* map);
+int queue_peek(queue_t* queue, QUEUE_ITEM* item);
 int queue_dequeue(queue_t* queue, QUEUE_ITEM* item);
+unsigned int queue_dequeue_n(queue_t* queue, QUEUE_ITEM* items, unsigned int n);
+void queue_clear(queue_t* queue);
+void queue_remap(queue_t* queue, const QUEUE_ITEM* map);
 int queue_is_empty(queue_t* queue);
 int queue_is_full(queue_t* queue);
 
 #endif // RASPICOMM_QUEUE_H
-
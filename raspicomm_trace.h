@@ -0,0 +1,228 @@
+// vim: noet:ts=4:sw=4
+/*
+ * Tracepoints of the RaspiComm driver, enabled through
+ * /sys/kernel/debug/tracing/events/raspicomm/. The events only record the
+ * raw values, the commands, classes and flags are decoded when the trace
+ * is read.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM raspicomm
+
+#if !defined(_RASPICOMM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RASPICOMM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// priority class of a transfer, see rpc_spi_class_t
+#define rpc_trace_class( cls ) \
+	__print_symbolic( cls, \
+		{ 0, "turn" }, { 1, "rx" }, { 2, "tx" }, { 3, "cfg" } )
+
+// MAX3140 command in the upper two bits of a word
+#define rpc_trace_cmd( data ) \
+	__print_symbolic( (data) >> 14, \
+		{ 0, "RdDat" }, { 1, "RdCfg" }, { 2, "WrDat" }, { 3, "WrCfg" } )
+
+// R, T and FE of a MAX3140 response
+#define rpc_trace_response( data ) \
+	__print_flags( (data) & 0xC400, "|", \
+		{ 0x8000, "R" }, { 0x4000, "T" }, { 0x0400, "FE" } )
+
+// a transfer has been added to the ring of its class
+TRACE_EVENT( rpc_spi_submit,
+	TP_PROTO( unsigned int port, unsigned int cls, u16 data,
+			unsigned int depth ),
+	TP_ARGS( port, cls, data, depth ),
+	TP_STRUCT__entry(
+		__field( unsigned int, port )
+		__field( unsigned int, cls )
+		__field( u16, data )
+		__field( unsigned int, depth )
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->cls = cls;
+		__entry->data = data;
+		__entry->depth = depth;
+	),
+	TP_printk( "ttyRPC%u %s %s %04x depth=%u",
+		__entry->port, rpc_trace_class( __entry->cls ),
+		rpc_trace_cmd( __entry->data ), __entry->data, __entry->depth )
+);
+
+// a transfer has been written to the SPI FIFO
+TRACE_EVENT( rpc_spi_start,
+	TP_PROTO( unsigned int port, unsigned int cls, u16 data, bool polled ),
+	TP_ARGS( port, cls, data, polled ),
+	TP_STRUCT__entry(
+		__field( unsigned int, port )
+		__field( unsigned int, cls )
+		__field( u16, data )
+		__field( bool, polled )
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->cls = cls;
+		__entry->data = data;
+		__entry->polled = polled;
+	),
+	TP_printk( "ttyRPC%u %s %s %04x %s",
+		__entry->port, rpc_trace_class( __entry->cls ),
+		rpc_trace_cmd( __entry->data ), __entry->data,
+		__entry->polled ? "polled" : "irq" )
+);
+
+// the response of a MAX3140 command has been read
+TRACE_EVENT( rpc_spi_complete,
+	TP_PROTO( unsigned int port, unsigned int cls, u16 sent, u16 rcvd,
+			bool polled ),
+	TP_ARGS( port, cls, sent, rcvd, polled ),
+	TP_STRUCT__entry(
+		__field( unsigned int, port )
+		__field( unsigned int, cls )
+		__field( u16, sent )
+		__field( u16, rcvd )
+		__field( bool, polled )
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->cls = cls;
+		__entry->sent = sent;
+		__entry->rcvd = rcvd;
+		__entry->polled = polled;
+	),
+	TP_printk( "ttyRPC%u %s %s %04x -> %04x %s data=%02x %s",
+		__entry->port, rpc_trace_class( __entry->cls ),
+		rpc_trace_cmd( __entry->sent ), __entry->sent, __entry->rcvd,
+		rpc_trace_response( __entry->rcvd ), __entry->rcvd & 0xFF,
+		__entry->polled ? "polled" : "irq" )
+);
+
+// the response could not be read from the FIFO, the transfer is repeated
+// unless spi_retry_max is reached
+TRACE_EVENT( rpc_spi_retry,
+	TP_PROTO( unsigned int port, unsigned int cls, u16 sent, u8 err ),
+	TP_ARGS( port, cls, sent, err ),
+	TP_STRUCT__entry(
+		__field( unsigned int, port )
+		__field( unsigned int, cls )
+		__field( u16, sent )
+		__field( u8, err )
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->cls = cls;
+		__entry->sent = sent;
+		__entry->err = err;
+	),
+	TP_printk( "ttyRPC%u %s %s %04x err=%02x",
+		__entry->port, rpc_trace_class( __entry->cls ),
+		rpc_trace_cmd( __entry->sent ), __entry->sent, __entry->err )
+);
+
+// the watchdog found a transfer without completion, done if the
+// controller had finished it and only the interrupt was lost
+TRACE_EVENT( rpc_spi_stall,
+	TP_PROTO( unsigned int port, unsigned int cls, u16 sent, u32 cs,
+			bool done ),
+	TP_ARGS( port, cls, sent, cs, done ),
+	TP_STRUCT__entry(
+		__field( unsigned int, port )
+		__field( unsigned int, cls )
+		__field( u16, sent )
+		__field( u32, cs )
+		__field( bool, done )
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->cls = cls;
+		__entry->sent = sent;
+		__entry->cs = cs;
+		__entry->done = done;
+	),
+	TP_printk( "ttyRPC%u %s %s %04x cs=%08x %s",
+		__entry->port, rpc_trace_class( __entry->cls ),
+		rpc_trace_cmd( __entry->sent ), __entry->sent, __entry->cs,
+		__entry->done ? "lost irq" : "restarted" )
+);
+
+// the SPI clock divider has been changed
+TRACE_EVENT( rpc_spi_clock,
+	TP_PROTO( unsigned int target_hz, unsigned long core_hz,
+			unsigned int cdiv ),
+	TP_ARGS( target_hz, core_hz, cdiv ),
+	TP_STRUCT__entry(
+		__field( unsigned int, target_hz )
+		__field( unsigned long, core_hz )
+		__field( unsigned int, cdiv )
+	),
+	TP_fast_assign(
+		__entry->target_hz = target_hz;
+		__entry->core_hz = core_hz;
+		__entry->cdiv = cdiv;
+	),
+	TP_printk( "target_hz=%u core_hz=%lu cdiv=%u",
+		__entry->target_hz, __entry->core_hz, __entry->cdiv )
+);
+
+// write() added bytes to the TX queue
+TRACE_EVENT( rpc_tx_queue,
+	TP_PROTO( unsigned int port, int written, unsigned int depth ),
+	TP_ARGS( port, written, depth ),
+	TP_STRUCT__entry(
+		__field( unsigned int, port )
+		__field( int, written )
+		__field( unsigned int, depth )
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->written = written;
+		__entry->depth = depth;
+	),
+	TP_printk( "ttyRPC%u written=%d depth=%u",
+		__entry->port, __entry->written, __entry->depth )
+);
+
+// the receive mode is on the bus, ns after the end of the last byte
+TRACE_EVENT( rpc_rs485_turnaround,
+	TP_PROTO( unsigned int port, u64 ns ),
+	TP_ARGS( port, ns ),
+	TP_STRUCT__entry(
+		__field( unsigned int, port )
+		__field( u64, ns )
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->ns = ns;
+	),
+	TP_printk( "ttyRPC%u turnaround_ns=%llu",
+		__entry->port, __entry->ns )
+);
+
+// received bytes have been pushed to the tty flip buffer
+TRACE_EVENT( rpc_rx_push,
+	TP_PROTO( unsigned int port, unsigned int count, unsigned int pushed ),
+	TP_ARGS( port, count, pushed ),
+	TP_STRUCT__entry(
+		__field( unsigned int, port )
+		__field( unsigned int, count )
+		__field( unsigned int, pushed )
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->count = count;
+		__entry->pushed = pushed;
+	),
+	TP_printk( "ttyRPC%u count=%u pushed=%u",
+		__entry->port, __entry->count, __entry->pushed )
+);
+
+#endif /* _RASPICOMM_TRACE_H */
+
+// the header is not in include/trace/events, the Makefile adds this
+// directory to the include path of module.o
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE raspicomm_trace
+#include <trace/define_trace.h>